@@ -0,0 +1,235 @@
+// Differential harness for the game servers. Sends the same requests to two servers in lockstep, usually
+// the C and the NodeJS ones, compares their replies byte for byte and shows their latencies side by side.
+// Both servers have to start from empty databases. Run with -h to see the options.
+#define main loadgen_main
+#define usage loadgen_usage
+#include "loadgen.c"
+#undef usage
+#undef main
+
+// Harness options, the rest are shared with the load generator.
+static char URL_B[200] = "http://127.0.0.1:8082";
+static int REQUESTS = 2000;
+static int SHOWN = 5;
+
+// Server under comparison, with a single keep-alive connection and the last reply.
+struct side {
+  const char *url; struct mg_connection *c;
+  int connected, done, status;
+  char *body; size_t len;
+  struct hist hist[LG_ROUTES];
+};
+static struct side cm_sides[2];
+static struct mg_mgr cm_mgr;
+
+// Replies that differ on each route, in the status or in the body.
+static unsigned long long cm_requests[LG_ROUTES], cm_status[LG_ROUTES], cm_body[LG_ROUTES];
+static int cm_shown = 0;
+
+static void cm_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+  struct side *s = (struct side *)fn_data;
+  if (ev == MG_EV_CONNECT) {
+    s->connected = 1;
+  } else if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+    s->status = mg_http_status(hm);
+    s->body = realloc(s->body, hm->body.len + 1); s->len = hm->body.len;
+    memcpy(s->body, hm->body.ptr, hm->body.len); s->done = 1;
+  } else if (ev == MG_EV_CLOSE) {
+    // A connection closed before the reply fails the request, the next one connects again.
+    if (!s->done) { s->status = 0; s->len = 0; s->done = 1; }
+    s->c = NULL; s->connected = 0;
+  }
+}
+
+// Send a request to a server and wait for its reply, up to 10 seconds. Returns the time it took in milliseconds.
+double cm_send(struct side *s, const char *req, size_t len)
+{
+  double start = now_ms();
+  s->done = 0; s->status = 0; s->len = 0;
+  if (s->c == NULL) { s->c = mg_http_connect(&cm_mgr, s->url, cm_fn, s); }
+  if (s->c == NULL) { s->done = 1; return 0; }
+  mg_send(s->c, req, len);
+  while (!s->done && now_ms() - start < 10000) { mg_mgr_poll(&cm_mgr, 1); }
+  if (!s->done) { s->c->is_closing = 1; s->done = 1; s->status = 0; }
+  return now_ms() - start;
+}
+
+// Replay ids of the first server paired with the ones of the second, by their position in the global rankings.
+#define CM_IDS 65536
+static struct { char a[32], b[32]; } cm_ids[CM_IDS];
+
+// Find the slot of a replay id of the first server, or the free one where it goes.
+int cm_id_slot(const char *a, size_t len)
+{
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; i < len; i++) { h = (h ^ (unsigned char)a[i]) * 16777619u; }
+  for (int i = 0; i < CM_IDS; i++) {
+    int k = (h + i) % CM_IDS;
+    if (cm_ids[k].a[0] == '\0' || (strlen(cm_ids[k].a) == len && memcmp(cm_ids[k].a, a, len) == 0)) { return k; }
+  } return -1;
+}
+
+// Compare the replay ids of a global rankings row. They're random on each server, so they match when the
+// pair is new or was already seen together. Ids too long for the table are compared as they are.
+int cm_id_match(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+  if (a_len >= 32 || b_len >= 32) { return a_len == b_len && memcmp(a, b, a_len) == 0; }
+  int k = cm_id_slot(a, a_len);
+  if (k < 0) { return 1; }
+  if (cm_ids[k].a[0] == '\0') {
+    memcpy(cm_ids[k].a, a, a_len); cm_ids[k].a[a_len] = '\0';
+    memcpy(cm_ids[k].b, b, b_len); cm_ids[k].b[b_len] = '\0'; return 1;
+  } return strlen(cm_ids[k].b) == b_len && memcmp(cm_ids[k].b, b, b_len) == 0;
+}
+
+// Compare two rankings replies. Rows are separated by dots and their fields by newlines, and the second
+// field of the global rows is the replay id. Everything else has to be the same byte for byte.
+int cm_ranking_equal(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+  const char *a_end = a + a_len, *b_end = b + b_len;
+  while (a < a_end && b < b_end) {
+    const char *ar = memchr(a, '.', a_end - a), *br = memchr(b, '.', b_end - b);
+    if (ar == NULL) { ar = a_end; } if (br == NULL) { br = b_end; }
+    // Rows of the global rankings start with the page index, the personal ones have zeros instead of ids.
+    const char *a1 = memchr(a, '\n', ar - a), *b1 = memchr(b, '\n', br - b);
+    const char *a2 = a1 ? memchr(a1 + 1, '\n', ar - a1 - 1) : NULL, *b2 = b1 ? memchr(b1 + 1, '\n', br - b1 - 1) : NULL;
+    if (a2 != NULL && b2 != NULL && a2 - a1 > 2 && b2 - b1 > 2) {
+      if (a1 - a != b1 - b || memcmp(a, b, a1 - a) != 0) { return 0; }
+      if (!cm_id_match(a1 + 1, a2 - a1 - 1, b1 + 1, b2 - b1 - 1)) { return 0; }
+      if (ar - a2 != br - b2 || memcmp(a2, b2, ar - a2) != 0) { return 0; }
+    } else if (ar - a != br - b || memcmp(a, b, ar - a) != 0) { return 0; }
+    a = ar + 1; b = br + 1;
+  } return a >= a_end && b >= b_end;
+}
+
+// Write a reply body on a single line, with the newlines and other control bytes escaped, cut at 300 bytes.
+void cm_print_body(const char *name, const struct side *s)
+{
+  printf("  %s %d: ", name, s->status);
+  for (size_t i = 0; i < s->len && i < 300; i++) {
+    unsigned char ch = (unsigned char)s->body[i];
+    if (ch == '\n') { printf("\\n"); } else if (ch < 0x20 || ch >= 0x7f) { printf("\\x%02x", ch); } else { putchar(ch); }
+  } printf("%s (%zu bytes)\n", s->len > 300 ? "..." : "", s->len);
+}
+
+// Build the request for the second server. Replays are asked for with its own id for the same ranking row.
+void cm_request_b(struct client *b, const struct client *a)
+{
+  b->len = 0;
+  if (a->route == LG_GETREPLAY) {
+    const char *id = strstr(a->req, "id="), *id_end = id ? id + strcspn(id + 3, "& ") + 3 : NULL;
+    int k = id ? cm_id_slot(id + 3, id_end - id - 3) : -1;
+    if (k >= 0 && cm_ids[k].a[0] != '\0') {
+      req_add(b, a->req, id + 3 - a->req); req_add(b, cm_ids[k].b, strlen(cm_ids[k].b));
+      req_add(b, id_end, a->len - (id_end - a->req)); return;
+    }
+  } req_add(b, a->req, a->len);
+}
+
+// Run a request on both servers and compare the replies.
+void cm_run(struct client *a, struct client *b)
+{
+  struct side *sa = &cm_sides[0], *sb = &cm_sides[1];
+  int route = a->route;
+  cm_request_b(b, a);
+  double ta = cm_send(sa, a->req, a->len);
+  double tb = cm_send(sb, b->req, b->len);
+  cm_requests[route]++;
+  if (sa->status == 200) { h_observe(&sa->hist[route], ta); } else { sa->hist[route].errors++; }
+  if (sb->status == 200) { h_observe(&sb->hist[route], tb); } else { sb->hist[route].errors++; }
+  // Replay ids for the next requests come from the first server rankings.
+  if (route == LG_GETRANKING && sa->status == 200) { replay_collect(mg_str_n(sa->body, sa->len)); }
+
+  int same = sa->status == sb->status, body = 1;
+  if (same) {
+    body = route == LG_GETRANKING ? cm_ranking_equal(sa->body, sa->len, sb->body, sb->len)
+      : sa->len == sb->len && memcmp(sa->body, sb->body, sa->len) == 0;
+  }
+  if (!same) { cm_status[route]++; } else if (!body) { cm_body[route]++; }
+  if ((!same || !body) && cm_shown < SHOWN) {
+    cm_shown++;
+    printf("\n%s differs: %.*s\n", lg_routes[route], (int)strcspn(a->req, "\r"), a->req);
+    cm_print_body("A", sa); cm_print_body("B", sb);
+  }
+}
+
+void usage()
+{
+  printf("Usage: compare [options]\n"
+    "  -a URL      First server, usually the C one (%s).\n"
+    "  -b URL      Second server, usually the NodeJS one (%s).\n"
+    "  -r N        Requests in the mix, after setting up the users (%d).\n"
+    "  -n N        Users registered first (%d).\n"
+    "  -p N        Scores posted for each user after registering them (%d).\n"
+    "  -s BYTES    Replay size (%d).\n"
+    "  -m MIX      Requests mix (GameEntry=%d,GetRanking=%d,GetReplay=%d,ScoreEntry=%d).\n"
+    "  -S SEED     Random seed.\n"
+    "  -j FILE     Send the requests of a journal written by the server, instead of the users setup and the mix.\n"
+    "  -v N        Differences shown in full (%d).\n",
+    URL, URL_B, REQUESTS, USERS, PREFILL, REPSIZE, MIX[0], MIX[1], MIX[2], MIX[3], SHOWN);
+}
+
+int main(int argc, char *argv[])
+{
+  // Parse options.
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i], *v = i + 1 < argc ? argv[i + 1] : NULL;
+    if (a[0] != '-' || a[1] == '\0' || a[2] != '\0' || a[1] == 'h' || v == NULL) { usage(); return 1; }
+    switch (a[1]) {
+      case 'a': snprintf(URL, sizeof(URL), "%s", v); break;
+      case 'b': snprintf(URL_B, sizeof(URL_B), "%s", v); break;
+      case 'r': REQUESTS = atoi(v); break;
+      case 'n': USERS = atoi(v); break;
+      case 'p': PREFILL = atoi(v); break;
+      case 's': REPSIZE = atoi(v); break;
+      case 'm': if (!mix_parse(v)) { usage(); return 1; } break;
+      case 'S': SEED = strtoull(v, NULL, 10); break;
+      case 'j': snprintf(JOURNAL, sizeof(JOURNAL), "%s", v); break;
+      case 'v': SHOWN = atoi(v); break;
+      default: usage(); return 1;
+    } i++;
+  }
+  if (USERS < 1 || REPSIZE < 1) { usage(); return 1; }
+  if (SEED) { lg_rng ^= SEED * 0x9E3779B97F4A7C15ULL; }
+  if (JOURNAL[0] != '\0' && !jn_load(JOURNAL)) { return 1; }
+  // Journal replay ids are the ones of the captured server, they're mapped to the first server ones.
+  KEEPIDS = 0;
+
+  mg_log_set("0");
+  mg_mgr_init(&cm_mgr);
+  replay_init();
+  cm_sides[0].url = URL; cm_sides[1].url = URL_B;
+  struct client a = { 0 }, b = { 0 };
+
+  // Register the users and post their first scores, then send the requests mix. Every step is compared.
+  size_t total = JOURNAL[0] != '\0' ? jn_count : (size_t)USERS * (1 + PREFILL) + REQUESTS;
+  printf("Comparing %s (A) with %s (B) on %zu requests...\n", URL, URL_B, total); fflush(stdout);
+  for (size_t i = 0; i < total; i++) {
+    if (JOURNAL[0] != '\0') { req_journal(&a, &jn_recs[i]); }
+    else if (i < (size_t)USERS) { req_build(&a, LG_GAMEENTRY, (int)i); }
+    else if (i < (size_t)USERS * (1 + PREFILL)) { req_build(&a, LG_SCOREENTRY, (int)(i % USERS)); }
+    else { req_build(&a, route_pick(), rnd_int(USERS)); }
+    cm_run(&a, &b);
+  }
+
+  // Show the differences and the latencies of both servers for each route.
+  unsigned long long diffs = 0;
+  printf("\n%-12s %9s %9s %9s %10s %10s %10s %10s %8s %8s\n", "Route", "Requests", "Status", "Body",
+    "A p50 ms", "B p50 ms", "A p99 ms", "B p99 ms", "A errors", "B errors");
+  for (int r = 0; r < LG_ROUTES; r++) {
+    if (cm_requests[r] == 0) { continue; }
+    const struct hist *ha = &cm_sides[0].hist[r], *hb = &cm_sides[1].hist[r];
+    printf("%-12s %9llu %9llu %9llu %10.3f %10.3f %10.3f %10.3f %8llu %8llu\n", lg_routes[r], cm_requests[r], cm_status[r], cm_body[r],
+      h_percentile(ha, 50), h_percentile(hb, 50), h_percentile(ha, 99), h_percentile(hb, 99), ha->errors, hb->errors);
+    diffs += cm_status[r] + cm_body[r];
+  }
+  if (diffs > 0) { printf("\n%llu replies differ, the first %d are shown above.\n", diffs, cm_shown); }
+  else { printf("\nAll the replies match.\n"); }
+
+  mg_mgr_free(&cm_mgr);
+  for (int s = 0; s < 2; s++) { free(cm_sides[s].body); }
+  free(a.req); free(b.req); free(lg_replay); free(jn_recs); free(jn_data);
+  return diffs > 0;
+}
\ No newline at end of file
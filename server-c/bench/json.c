@@ -0,0 +1,157 @@
+// JSON benchmark. Times the mjson tokenizer and path lookups on documents shaped like the ones the server stores,
+// once for each string scanning implementation the CPU supports. Results are written as JSON so builds can be compared.
+// Run with -h to see the options.
+#include "../mjson/mjson.c"
+#include <stdio.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Benchmark options.
+static char OUTPUT[260] = "";
+static int BUDGET = 500;
+
+// Get a monotonic timestamp in milliseconds.
+double now_ms()
+{
+#ifdef _WIN32
+  LARGE_INTEGER t, f;
+  QueryPerformanceCounter(&t); QueryPerformanceFrequency(&f);
+  return (double)t.QuadPart * 1000.0 / (double)f.QuadPart;
+#else
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+// Documents, built the way the server writes them. The pretty one stands in for hand edited or exported data.
+struct bn_doc { const char *name; char *buf; int len; const char *path; };
+static struct bn_doc bn_docs[5];
+static int bn_docs_count = 0;
+static volatile int bn_sink;
+
+// Append a ranking object, like sb_score() does.
+int bn_score(char *buf, const char *_id, int mode)
+{
+  int n = 0;
+  if (_id) { n += sprintf(buf + n, "{\"_id\":\"%s\",", _id); } else { buf[n++] = '{'; }
+  n += sprintf(buf + n, "\"id\":\"bn%06d\",\"mode\":%d,\"score\":%d,\"jewel\":%d,\"level\":%d,\"class\":%d,\"time\":%d}",
+    rand() % 100000, mode, rand() % 1000000, rand() % 1000, 1 + rand() % 50, 100 + rand() % 30, 3600 + rand() % 200000);
+  return n;
+}
+
+// Build a user document with the given amount of personal rankings.
+char *bn_user(int count, int *len)
+{
+  char *buf = malloc(200 + count * 120); int n = 0;
+  n += sprintf(buf + n, "{\"id\":\"bn%06d\",\"pass\":\"pw\",\"count\":%d,\"rankings\":[", rand() % 100000, count);
+  for (int i = 0; i < count; i++) { if (i > 0) { buf[n++] = ','; } n += bn_score(buf + n, NULL, i % 3); }
+  n += sprintf(buf + n, "]}"); *len = n;
+  return buf;
+}
+
+// Build a document with long strings, like notes or encoded data, where the wider vectors come into play.
+char *bn_long(int *len)
+{
+  static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char *buf = malloc(8192); int n = 0;
+  n += sprintf(buf + n, "{\"id\":\"bn%06d\",\"note\":\"", rand() % 100000);
+  for (int i = 0; i < 12; i++) { n += sprintf(buf + n, "%sGood run on the hard mode, the last stage took a while.", i > 0 ? " " : ""); }
+  n += sprintf(buf + n, "\",\"data\":\"");
+  for (int i = 0; i < 4096; i++) { buf[n++] = b64[rand() % 64]; }
+  n += sprintf(buf + n, "\",\"count\":0}"); *len = n;
+  return buf;
+}
+
+void bn_add(const char *name, char *buf, int len, const char *path)
+{
+  bn_docs[bn_docs_count++] = (struct bn_doc){ name, buf, len, path };
+}
+
+// String scanning implementations, the vector ones are added when the CPU supports them.
+// The byte at a time loop is the original one, to compare against.
+struct bn_impl { const char *name; int simd; };
+static struct bn_impl bn_impls[3] = { { "scalar", 0 } };
+static int bn_impls_count = 1;
+
+// Run an operation over a document for the time budget, in batches, and write its results.
+#define BN_BATCH 1000
+void bn_run(FILE *out, const struct bn_doc *d, const char *impl, const char *op, int first)
+{
+  int lookup = strcmp(op, "find") == 0; long long count = 0; double total = 0;
+  const char *p; int n;
+  while (count < 3 * BN_BATCH || total < BUDGET) {
+    double t = now_ms();
+    for (int k = 0; k < BN_BATCH; k++) {
+      bn_sink = lookup ? mjson_find(d->buf, d->len, d->path, &p, &n) : mjson(d->buf, d->len, NULL, NULL);
+    }
+    total += now_ms() - t; count += BN_BATCH;
+  }
+  fprintf(out, "%s\n    { \"doc\": \"%s\", \"bytes\": %d, \"impl\": \"%s\", \"op\": \"%s\", \"iterations\": %lld, "
+    "\"docs_per_sec\": %.1f, \"mb_per_sec\": %.1f, \"mean_ns\": %.1f }", first ? "" : ",",
+    d->name, d->len, impl, op, count, count * 1000.0 / total, count * (double)d->len / total / 1000.0,
+    total * 1000000.0 / count);
+  fflush(out);
+}
+
+void usage()
+{
+  printf("Usage: json [options]\n"
+    "  -t MS       Time spent on each operation (%d).\n"
+    "  -o FILE     Write the results to a file instead of the console.\n", BUDGET);
+}
+
+int main(int argc, char *argv[])
+{
+  // Parse options.
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i], *v = i + 1 < argc ? argv[i + 1] : NULL;
+    if (a[0] != '-' || a[1] == '\0' || a[2] != '\0' || a[1] == 'h' || v == NULL) { usage(); return 1; }
+    switch (a[1]) {
+      case 't': BUDGET = atoi(v); break;
+      case 'o': snprintf(OUTPUT, sizeof(OUTPUT), "%s", v); break;
+      default: usage(); return 1;
+    } i++;
+  }
+  FILE *out = OUTPUT[0] ? fopen(OUTPUT, "w") : stdout;
+  if (out == NULL) { fprintf(stderr, "Couldn't create %s\n", OUTPUT); return 1; }
+
+  // Build the documents: a global ranking row, and users with single and multiple scores.
+  srand(1); int len;
+  char *row = malloc(300); len = bn_score(row, "9089935488964676", 0);
+  bn_add("ranking_row", row, len, "$.time");
+  char *single = bn_user(3, &len); bn_add("user_single", single, len, "$.rankings[2].time");
+  char *multi = bn_user(30, &len); bn_add("user_multi", multi, len, "$.rankings[29].time");
+  char *pretty = NULL;
+  mjson_pretty(multi, len, "  ", mjson_print_dynamic_buf, &pretty);
+  bn_add("user_multi_pretty", pretty, strlen(pretty), "$.rankings[29].time");
+  char *lng = bn_long(&len); bn_add("long_strings", lng, len, "$.count");
+
+#if MJSON_ENABLE_SIMD
+  mjson_simd_init();
+  if (mjson_simd >= 1) { bn_impls[bn_impls_count++] = (struct bn_impl){ "sse2", 1 }; }
+  if (mjson_simd >= 2) { bn_impls[bn_impls_count++] = (struct bn_impl){ "avx2", 2 }; }
+#endif
+
+  // Every implementation has to find the same tokens, the results are compared before timing them.
+  fprintf(out, "{\n  \"results\": ["); int first = 1;
+  for (int i = 0; i < bn_docs_count; i++) {
+    int expect = -1;
+    for (int m = 0; m < bn_impls_count; m++) {
+#if MJSON_ENABLE_SIMD
+      mjson_simd = bn_impls[m].simd;
+#endif
+      int got = mjson(bn_docs[i].buf, bn_docs[i].len, NULL, NULL);
+      if (m > 0 && got != expect) { fprintf(stderr, "%s: %s returned %d, expected %d\n", bn_docs[i].name, bn_impls[m].name, got, expect); return 1; }
+      expect = got;
+      fprintf(stderr, "%s (%d bytes): %s\n", bn_docs[i].name, bn_docs[i].len, bn_impls[m].name);
+      bn_run(out, &bn_docs[i], bn_impls[m].name, "tokenize", first); first = 0;
+      bn_run(out, &bn_docs[i], bn_impls[m].name, "find", first);
+    }
+  }
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout) { fclose(out); }
+  for (int i = 0; i < bn_docs_count; i++) { free(bn_docs[i].buf); }
+  return 0;
+}
\ No newline at end of file
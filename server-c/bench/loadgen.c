@@ -0,0 +1,788 @@
+// Load generator for the game servers. Speaks the same protocol as the game client, so it works
+// against both the C and the NodeJS servers. Run with -h to see the options.
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../mongoose/mongoose.h"
+
+// Routes generated, and their default share of the requests. Other routes only come from journals.
+enum { LG_GAMEENTRY, LG_GETRANKING, LG_GETREPLAY, LG_SCOREENTRY, LG_OTHER, LG_ROUTES };
+static const char *lg_routes[LG_ROUTES] = { "GameEntry", "GetRanking", "GetReplay", "ScoreEntry", "Other" };
+static int MIX[LG_ROUTES] = { 10, 60, 20, 10, 0 };
+
+// Load generator options.
+static char URL[200] = "http://127.0.0.1:8081";
+static int DURATION = 10;
+static int CLIENTS = 8;
+static int MAXCLIENTS = 256;
+static double RATE = 0;
+static int THINK = 0;
+static int USERS = 100;
+static int PREFILL = 1;
+static int REPSIZE = 16 * 1024;
+static unsigned long long SEED = 0;
+// Soak mode, sampling the server resources every given seconds. 0 disables it.
+static int INTERVAL = 0;
+static char SAMPLES[260] = "";
+// Request journal replayed instead of the mix, at its original pace times the speed, or as fast as possible with 0.
+// Replay ids are mapped to the ones found in the rankings, unless they're kept for servers with a copy of the data.
+static char JOURNAL[260] = "";
+static double SPEED = 1;
+static int KEEPIDS = 0;
+
+// Get a monotonic timestamp in milliseconds.
+double now_ms()
+{
+#ifdef _WIN32
+  LARGE_INTEGER t, f;
+  QueryPerformanceCounter(&t); QueryPerformanceFrequency(&f);
+  return (double)t.QuadPart * 1000.0 / (double)f.QuadPart;
+#else
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+// Pseudo-random numbers (xorshift64*), seeded from the options so runs can be repeated.
+static unsigned long long lg_rng = 88172645463325252ULL;
+unsigned long long rnd()
+{
+  lg_rng ^= lg_rng >> 12; lg_rng ^= lg_rng << 25; lg_rng ^= lg_rng >> 27;
+  return lg_rng * 2685821657736338717ULL;
+}
+
+// Get a random number in the [0, n) range.
+int rnd_int(int n)
+{
+  return (int)(rnd() % (unsigned long long)n);
+}
+
+// Latency histogram with logarithmic buckets 1% apart, from 1 microsecond up to about 11 minutes.
+#define H_BUCKETS 2048
+#define H_BASE 1.01
+struct hist { unsigned long long count, errors, bytes, bucket[H_BUCKETS]; double max; };
+static struct hist lg_hist[LG_ROUTES];
+
+// Failed requests by their reply status, or by what happened to them when there was no reply.
+// Statuses past the table size are counted together in its last entry.
+enum { ER_CONNECT = -1, ER_CLOSED = -2, ER_TIMEOUT = -3 };
+#define ER_KINDS 16
+struct err_kind { int status; unsigned long long count[LG_ROUTES]; };
+static struct err_kind lg_errs[ER_KINDS];
+static int lg_nerrs = 0;
+
+// Count a failed request in its route histogram and by its kind.
+void err_count(int route, int status)
+{
+  int i = 0;
+  while (i < lg_nerrs && lg_errs[i].status != status) { i++; }
+  if (i == ER_KINDS) { i = ER_KINDS - 1; lg_errs[i].status = 0; }
+  else if (i == lg_nerrs) { lg_errs[lg_nerrs++].status = status; }
+  lg_errs[i].count[route]++; lg_hist[route].errors++;
+}
+
+// Get the description of an error kind.
+const char *err_name(char *buf, size_t size, int status)
+{
+  if (status == ER_CONNECT) { snprintf(buf, size, "Couldn't connect"); }
+  else if (status == ER_CLOSED) { snprintf(buf, size, "Closed, no reply"); }
+  else if (status == ER_TIMEOUT) { snprintf(buf, size, "No reply by end"); }
+  else if (status == 0) { snprintf(buf, size, "Other statuses"); }
+  else { snprintf(buf, size, "Status %d", status); }
+  return buf;
+}
+
+// Add a successful request duration in milliseconds to a histogram.
+void h_observe(struct hist *h, double ms)
+{
+  double us = ms * 1000.0;
+  int i = us < 1.0 ? 0 : (int)(log(us) / log(H_BASE));
+  if (i >= H_BUCKETS) { i = H_BUCKETS - 1; }
+  h->bucket[i]++; h->count++;
+  if (ms > h->max) { h->max = ms; }
+}
+
+// Get the given percentile of a histogram in milliseconds, from the middle of its bucket but never past the maximum.
+double h_percentile(const struct hist *h, double p)
+{
+  unsigned long long rank = (unsigned long long)ceil(p / 100.0 * h->count), seen = 0;
+  for (int i = 0; i < H_BUCKETS; i++) {
+    seen += h->bucket[i];
+    if (seen >= rank && seen > 0) { return fmin(sqrt(pow(H_BASE, i) * pow(H_BASE, i + 1)) / 1000.0, h->max); }
+  } return 0;
+}
+
+// Synthetic replay, a stream of input states with short runs like the real ones.
+static char *lg_replay;
+void replay_init()
+{
+  lg_replay = malloc(REPSIZE);
+  for (int i = 0; i < REPSIZE;) {
+    char v = (char)rnd_int(16); int run = 1 + rnd_int(24);
+    while (run-- > 0 && i < REPSIZE) { lg_replay[i++] = v; }
+  }
+}
+
+// Replay ids seen in the global rankings, used for the replay requests.
+#define LG_REPLAYS 4096
+static char lg_replay_ids[LG_REPLAYS][32];
+static int lg_replay_count = 0;
+
+// Collect the replay ids from a global rankings response. Rows are separated by dots,
+// and the replay id is the second of their fields.
+void replay_collect(struct mg_str body)
+{
+  const char *p = body.ptr, *end = body.ptr + body.len;
+  while (p < end) {
+    const char *row = p, *row_end = memchr(p, '.', end - p);
+    if (row_end == NULL) { row_end = end; }
+    const char *id = memchr(row, '\n', row_end - row);
+    const char *id_end = id ? memchr(id + 1, '\n', row_end - id - 1) : NULL;
+    if (id_end != NULL && id_end - id - 1 > 1 && id_end - id - 1 < 32) {
+      int slot = lg_replay_count < LG_REPLAYS ? lg_replay_count : rnd_int(LG_REPLAYS);
+      memcpy(lg_replay_ids[slot], id + 1, id_end - id - 1); lg_replay_ids[slot][id_end - id - 1] = '\0';
+      if (lg_replay_count < LG_REPLAYS) { lg_replay_count++; }
+    } p = row_end + 1;
+  }
+}
+
+// Virtual game client, with a single keep-alive connection and at most one request in flight.
+struct client {
+  struct mg_connection *c;
+  int connected, busy, route, global;
+  double start, ready;
+  char *req; size_t len, size;
+};
+static struct client *lg_clients;
+static int lg_nclients = 0;
+static struct mg_mgr lg_mgr;
+// Open loop, requests are sent when due instead of when a connection is free.
+static int lg_open = 0;
+// Measurement phase, requests made while setting up the users aren't counted.
+enum { PH_REGISTER, PH_PREFILL, PH_RUN, PH_DRAIN };
+static int lg_phase = PH_REGISTER, lg_setup = 0, lg_inflight = 0;
+
+// Append formatted text to the client request.
+void req_printf(struct client *cl, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (cl->len + n + 1 > cl->size) { cl->size = (cl->len + n + 1) * 2; cl->req = realloc(cl->req, cl->size); }
+  va_start(ap, fmt);
+  vsnprintf(cl->req + cl->len, n + 1, fmt, ap);
+  va_end(ap);
+  cl->len += n;
+}
+
+// Append raw bytes to the client request.
+void req_add(struct client *cl, const char *buf, size_t n)
+{
+  if (cl->len + n > cl->size) { cl->size = (cl->len + n) * 2; cl->req = realloc(cl->req, cl->size); }
+  memcpy(cl->req + cl->len, buf, n); cl->len += n;
+}
+
+// Append the headers and the body of a score entry, with the replay as a multipart form file like the game client sends it.
+void req_multipart(struct client *cl, const char *replay, size_t len)
+{
+  const char *boundary = "----JMReplayBoundary";
+  char head[200], tail[60];
+  int head_len = snprintf(head, sizeof(head), "--%s\r\nContent-Disposition: form-data; name=\"fileName\"; filename=\"replay.rep\"\r\n"
+    "Content-Type: application/octet-stream\r\n\r\n", boundary);
+  int tail_len = snprintf(tail, sizeof(tail), "\r\n--%s--\r\n", boundary);
+  req_printf(cl, "Content-Type: multipart/form-data; boundary=%s\r\nContent-Length: %d\r\n\r\n", boundary, head_len + (int)len + tail_len);
+  req_add(cl, head, head_len); req_add(cl, replay, len); req_add(cl, tail, tail_len);
+}
+
+// Build a request for the given route and user, like the game client does.
+void req_build(struct client *cl, int route, int user)
+{
+  struct mg_str host = mg_url_host(URL);
+  char id[17]; snprintf(id, sizeof(id), "lg%05d", user);
+  int mode = rnd_int(3);
+  cl->len = 0; cl->global = 0;
+  // Replays can only be requested once some have been seen in the rankings.
+  if (route == LG_GETREPLAY && lg_replay_count == 0) { route = LG_GETRANKING; }
+  cl->route = route;
+  if (route == LG_GAMEENTRY) {
+    req_printf(cl, "GET /JM_test/service/GameEntry?id=%s&pass=pw%s HTTP/1.1\r\nHost: %.*s\r\n\r\n", id, id, (int)host.len, host.ptr);
+  } else if (route == LG_GETRANKING) {
+    // Mix of the personal rankings, the top of the global ones, other pages, and the page with the user.
+    int kind = rnd_int(100), view = 0;
+    if (kind < 25) {
+      req_printf(cl, "GET /JM_test/service/GetRanking?id=%s&mode=%d&view=0 HTTP/1.1\r\n", id, mode);
+    } else {
+      cl->global = 1;
+      if (kind < 60) { view = -1; } else if (kind < 80) { view = 1 + rnd_int(1 + USERS * PREFILL / 30); }
+      if (kind < 80) { req_printf(cl, "GET /JM_test/service/GetRanking?mode=%d&view=%d HTTP/1.1\r\n", mode, view); }
+      else { req_printf(cl, "GET /JM_test/service/GetRanking?id=%s&mode=%d&view=-1 HTTP/1.1\r\n", id, mode); }
+    } req_printf(cl, "Host: %.*s\r\n\r\n", (int)host.len, host.ptr);
+  } else if (route == LG_GETREPLAY) {
+    req_printf(cl, "GET /JM_test/service/GetReplay?id=%s HTTP/1.1\r\nHost: %.*s\r\n\r\n",
+      lg_replay_ids[rnd_int(lg_replay_count)], (int)host.len, host.ptr);
+  } else {
+    // Score entries upload the replay, with the score in the query.
+    req_printf(cl, "POST /JM_test/service/ScoreEntry?id=%s&mode=%d&score=%d&jewel=%d&level=%d&class=%d&time=%d HTTP/1.1\r\nHost: %.*s\r\n",
+      id, mode, rnd_int(1000000), rnd_int(1000), 1 + rnd_int(50), 100 + rnd_int(30), 3600 + rnd_int(200000), (int)host.len, host.ptr);
+    req_multipart(cl, lg_replay, REPSIZE);
+  }
+}
+
+// Requests read from a journal, in the order the server got them.
+struct jn_rec { double t; struct mg_str method, uri, query, body; int route; };
+static struct jn_rec *jn_recs;
+static size_t jn_count = 0, jn_next = 0;
+static char *jn_data;
+
+// Read a little-endian number of the given size.
+unsigned long long jn_get(const unsigned char *p, int n)
+{
+  unsigned long long v = 0;
+  for (int i = n - 1; i >= 0; i--) { v = (v << 8) | p[i]; } return v;
+}
+
+// Load a request journal written by the server. See jn_write() in server.c for its format.
+int jn_load(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) { printf("Couldn't open %s\n", path); return 0; }
+  fseek(fp, 0, SEEK_END); long size = ftell(fp); rewind(fp);
+  jn_data = malloc(size > 0 ? size : 1);
+  if (size < 4 || fread(jn_data, 1, size, fp) != (size_t)size || memcmp(jn_data, "JMJ1", 4) != 0) {
+    printf("%s isn't a request journal\n", path); fclose(fp); return 0;
+  } fclose(fp);
+  size_t cap = 0;
+  for (long ofs = 4; ofs + 17 <= size;) {
+    const unsigned char *h = (const unsigned char *)jn_data + ofs;
+    size_t m_len = h[8], u_len = jn_get(h + 9, 2), q_len = jn_get(h + 11, 2), b_len = jn_get(h + 13, 4);
+    // A record cut short by a crash ends the journal.
+    if (ofs + 17 + m_len + u_len + q_len + b_len > (size_t)size) { break; }
+    if (jn_count == cap) { cap = cap ? cap * 2 : 4096; jn_recs = realloc(jn_recs, cap * sizeof(struct jn_rec)); }
+    struct jn_rec *j = &jn_recs[jn_count++];
+    const char *p = jn_data + ofs + 17;
+    j->t = jn_get(h, 8) / 1000.0;
+    j->method = mg_str_n(p, m_len); j->uri = mg_str_n(p + m_len, u_len);
+    j->query = mg_str_n(p + m_len + u_len, q_len); j->body = mg_str_n(p + m_len + u_len + q_len, b_len);
+    j->route = LG_OTHER;
+    for (int r = 0; r < LG_OTHER; r++) {
+      size_t n = strlen(lg_routes[r]);
+      if (u_len > n && j->uri.ptr[u_len - n - 1] == '/' && memcmp(j->uri.ptr + u_len - n, lg_routes[r], n) == 0) { j->route = r; }
+    } ofs += 17 + m_len + u_len + q_len + b_len;
+  }
+  if (jn_count == 0) { printf("%s has no requests\n", path); return 0; }
+  return 1;
+}
+
+// Replay ids from the journal mapped to the ones seen in the rankings, so each captured id keeps
+// getting the same replay and the cache sees the same popularity as the captured traffic.
+#define JN_IDMAP 65536
+static struct { char from[32]; int to; } jn_idmap[JN_IDMAP];
+static int jn_mapped = 0;
+const char *jn_replay_id(const char *id)
+{
+  if (lg_replay_count == 0) { return id; }
+  unsigned int h = 2166136261u;
+  for (const char *p = id; *p; p++) { h = (h ^ (unsigned char)*p) * 16777619u; }
+  for (int i = 0; i < JN_IDMAP; i++) {
+    int k = (h + i) % JN_IDMAP;
+    if (jn_idmap[k].from[0] == '\0') {
+      snprintf(jn_idmap[k].from, sizeof(jn_idmap[k].from), "%s", id);
+      jn_idmap[k].to = jn_mapped++ % LG_REPLAYS;
+    }
+    if (strcmp(jn_idmap[k].from, id) == 0) { return lg_replay_ids[jn_idmap[k].to % lg_replay_count]; }
+  } return lg_replay_ids[h % lg_replay_count];
+}
+
+// Build a request from a journal record.
+void req_journal(struct client *cl, const struct jn_rec *j)
+{
+  struct mg_str host = mg_url_host(URL);
+  cl->len = 0; cl->route = j->route; cl->global = j->route == LG_GETRANKING;
+  req_printf(cl, "%.*s %.*s", (int)j->method.len, j->method.ptr, (int)j->uri.len, j->uri.ptr);
+  if (j->route == LG_GETREPLAY && !KEEPIDS) {
+    char id[32] = "";
+    mg_http_get_var(&j->query, "id", id, sizeof(id));
+    req_printf(cl, "?id=%s", jn_replay_id(id));
+  } else if (j->query.len > 0) { req_printf(cl, "?%.*s", (int)j->query.len, j->query.ptr); }
+  req_printf(cl, " HTTP/1.1\r\nHost: %.*s\r\n", (int)host.len, host.ptr);
+  if (j->body.len > 0) { req_multipart(cl, j->body.ptr, j->body.len); } else { req_printf(cl, "\r\n"); }
+}
+
+// Route getting half of the requests in the current soak interval, -1 for none.
+static int lg_focus = -1;
+
+// Pick a route following the requests mix.
+int route_pick()
+{
+  if (lg_focus >= 0 && rnd_int(2) == 0) { return lg_focus; }
+  int total = 0, r;
+  for (r = 0; r < LG_OTHER; r++) { total += MIX[r]; }
+  int n = rnd_int(total > 0 ? total : 1);
+  for (r = 0; r < LG_OTHER - 1; r++) {
+    if (n < MIX[r]) { break; } n -= MIX[r];
+  } return r;
+}
+
+static void cl_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data);
+
+// Send the built request, connecting first if needed. The start time is when the request was due,
+// so delays waiting for a connection in the open-loop mode are part of the latency.
+void cl_send(struct client *cl, double start)
+{
+  cl->busy = 1; cl->start = start; lg_inflight++;
+  if (cl->c == NULL) { cl->c = mg_http_connect(&lg_mgr, URL, cl_fn, cl); }
+  if (cl->c == NULL) { err_count(cl->route, ER_CONNECT); cl->busy = 0; lg_inflight--; cl->ready = now_ms() + 100; }
+  else if (cl->connected) { mg_send(cl->c, cl->req, cl->len); }
+}
+
+// Finish the request in flight with its reply status or error kind, counting it only while measuring.
+void cl_done(struct client *cl, int status, struct mg_http_message *hm)
+{
+  if (!cl->busy) { return; }
+  double t = now_ms(); cl->busy = 0; lg_inflight--;
+  if (status == 200 && cl->route == LG_GETRANKING && cl->global) { replay_collect(hm->body); }
+  if (lg_phase == PH_RUN || lg_phase == PH_DRAIN) {
+    if (status == 200) { h_observe(&lg_hist[cl->route], t - cl->start); lg_hist[cl->route].bytes += hm->message.len; } else { err_count(cl->route, status); }
+  } cl->ready = t + (lg_phase == PH_RUN ? THINK : 0);
+}
+
+static void cl_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+  struct client *cl = (struct client *)fn_data;
+  if (ev == MG_EV_CONNECT) {
+    cl->connected = 1;
+    if (cl->busy) { mg_send(c, cl->req, cl->len); }
+  } else if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+    cl_done(cl, mg_http_status(hm), hm);
+  } else if (ev == MG_EV_CLOSE) {
+    // Requests cut by the server are errors, the connection is opened again on the next one.
+    cl_done(cl, ER_CLOSED, NULL); cl->c = NULL; cl->connected = 0;
+    if (cl->ready < now_ms() + 10) { cl->ready = now_ms() + 10; }
+  }
+}
+
+// Get a free client, opening a new connection in the open-loop mode if all of them are busy.
+struct client *cl_idle(double now)
+{
+  for (int i = 0; i < lg_nclients; i++) {
+    if (!lg_clients[i].busy && lg_clients[i].ready <= now) { return &lg_clients[i]; }
+  }
+  if (lg_open && lg_nclients < MAXCLIENTS) { return &lg_clients[lg_nclients++]; }
+  return NULL;
+}
+
+// Pending arrivals for the open-loop mode, with the time each one was due.
+#define LG_QUEUE 65536
+static double lg_queue[LG_QUEUE];
+static size_t lg_queue_rec[LG_QUEUE];
+static size_t lg_qhead = 0, lg_qtail = 0;
+static unsigned long long lg_overflow = 0;
+
+// Server resources sampled in the soak mode, from its metrics. The growth allowed before flagging one
+// is the larger of 1% of its starting value and the given minimum.
+enum { SK_RSS, SK_PRIVATE, SK_HEAP, SK_BLOCKS, SK_MAP, SK_REPDIR, SK_ARENA, SK_CACHE, SK_METRICS };
+static const struct { const char *name, *label; int bytes; double min; } sk_metrics[SK_METRICS] = {
+  { "jm_process_resident_bytes", "RSS", 1, 1 << 20 }, { "jm_process_private_bytes", "Private", 1, 1 << 20 },
+  { "jm_heap_used_bytes", "Heap used", 1, 256 << 10 }, { "jm_heap_blocks", "Heap blocks", 0, 1000 },
+  { "jm_db_map_used_bytes", "DB map used", 1, 1 << 20 }, { "jm_replay_dir_bytes", "Replay dir", 1, 1 << 20 },
+  { "jm_arena_bytes", "Arena", 1, 256 << 10 }, { "jm_replay_cache_bytes", "Replay cache", 1, 1 << 20 }
+};
+// Sample of the server resources, with the requests done by then. Missing metrics are negative.
+struct sample { double t, v[SK_METRICS]; unsigned long long req[LG_ROUTES]; };
+static struct sample *sk_samples, sk_pending;
+static int sk_count = 0, sk_size = 0, sk_busy = 0, sk_failed = 0;
+static FILE *sk_csv;
+
+// Get a metric value from a Prometheus text exposition, only for metrics without labels.
+double sk_value(struct mg_str body, const char *name)
+{
+  size_t n = strlen(name);
+  for (const char *p = body.ptr, *end = body.ptr + body.len; p < end;) {
+    const char *eol = memchr(p, '\n', end - p); if (eol == NULL) { eol = end; }
+    if ((size_t)(eol - p) > n && strncmp(p, name, n) == 0 && p[n] == ' ') { return strtod(p + n + 1, NULL); }
+    p = eol + 1;
+  } return -1;
+}
+
+// Format a metric value, with units for the sizes.
+const char *sk_format(char *buf, size_t size, double v, int bytes)
+{
+  double a = fabs(v);
+  if (!bytes) { snprintf(buf, size, "%.0f", v); }
+  else if (a >= 1 << 30) { snprintf(buf, size, "%.2f GB", v / (1 << 30)); }
+  else if (a >= 1 << 20) { snprintf(buf, size, "%.2f MB", v / (1 << 20)); }
+  else if (a >= 1 << 10) { snprintf(buf, size, "%.1f KB", v / (1 << 10)); }
+  else { snprintf(buf, size, "%.1f B", v); }
+  return buf;
+}
+
+// Store a finished sample, showing it as it comes in.
+void sk_store(struct mg_str body)
+{
+  struct sample *s = &sk_pending; char rss[20], heap[20], map[20], dir[20];
+  for (int m = 0; m < SK_METRICS; m++) { s->v[m] = sk_value(body, sk_metrics[m].name); }
+  if (sk_count == sk_size) { sk_size = sk_size ? sk_size * 2 : 256; sk_samples = realloc(sk_samples, sk_size * sizeof(struct sample)); }
+  sk_samples[sk_count++] = *s;
+  unsigned long long total = 0, prev = 0;
+  for (int r = 0; r < LG_ROUTES; r++) { total += s->req[r]; prev += sk_count > 1 ? sk_samples[sk_count - 2].req[r] : 0; }
+  double secs = sk_count > 1 ? s->t - sk_samples[sk_count - 2].t : 0;
+  // The heap and the replays directory are only walked by servers running with Metrics=2.
+  if (sk_count == 1 && s->v[SK_HEAP] < 0) { fprintf(stderr, "No heap or replays directory metrics, the server needs Metrics=2.\n"); }
+  printf("[%3d:%02d:%02d] %8.1f req/s  RSS %s  heap %s  map %s  replays %s\n", (int)(s->t / 3600), (int)(s->t / 60) % 60, (int)s->t % 60,
+    secs > 0 ? (total - prev) / secs : 0, sk_format(rss, sizeof(rss), s->v[SK_RSS], 1),
+    s->v[SK_HEAP] < 0 ? "-" : sk_format(heap, sizeof(heap), s->v[SK_HEAP], 1), sk_format(map, sizeof(map), s->v[SK_MAP], 1),
+    s->v[SK_REPDIR] < 0 ? "-" : sk_format(dir, sizeof(dir), s->v[SK_REPDIR], 1));
+  fflush(stdout);
+  if (sk_csv != NULL) {
+    fprintf(sk_csv, "%.1f", s->t);
+    for (int r = 0; r < LG_ROUTES; r++) { fprintf(sk_csv, ",%llu", s->req[r]); }
+    for (int m = 0; m < SK_METRICS; m++) { fprintf(sk_csv, ",%.0f", s->v[m]); }
+    fprintf(sk_csv, "\n"); fflush(sk_csv);
+  }
+}
+
+static void sk_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+  if (ev == MG_EV_CONNECT) {
+    struct mg_str host = mg_url_host(URL);
+    mg_printf(c, "GET /metrics HTTP/1.1\r\nHost: %.*s\r\n\r\n", (int)host.len, host.ptr);
+  } else if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+    if (mg_http_status(hm) == 200) { sk_store(hm->body); } else { sk_failed++; }
+    // The server hides its metrics unless they're enabled, and from other machines.
+    if (mg_http_status(hm) == 404 && sk_failed == 1) { fprintf(stderr, "No metrics, the server needs Metrics=2 and loadgen has to run on its machine.\n"); }
+    sk_busy = 0; c->is_closing = 1;
+  } else if (ev == MG_EV_CLOSE && sk_busy) { sk_busy = 0; sk_failed++; }
+  (void)fn_data;
+}
+
+// Start sampling the server resources, on a connection of its own so it doesn't wait behind the requests.
+// Walking the server heap takes a while, the requests done are the ones counted when the sample was asked for.
+void sk_scrape(double t)
+{
+  if (sk_busy) { sk_failed++; return; }
+  sk_pending.t = t / 1000.0;
+  for (int r = 0; r < LG_ROUTES; r++) { sk_pending.req[r] = lg_hist[r].count + lg_hist[r].errors; }
+  if (mg_http_connect(&lg_mgr, URL, sk_fn, NULL) != NULL) { sk_busy = 1; } else { sk_failed++; }
+}
+
+// Move the soak focus to the next route in the mix.
+void sk_rotate()
+{
+  for (int i = 0; i < LG_ROUTES; i++) {
+    lg_focus = (lg_focus + 1) % LG_ROUTES;
+    if (MIX[lg_focus] > 0) { return; }
+  } lg_focus = -1;
+}
+
+// Solve a small linear system in place with Gaussian elimination. Returns 0 if it's singular.
+int sk_solve(int n, double a[LG_ROUTES][LG_ROUTES], double b[LG_ROUTES])
+{
+  for (int i = 0; i < n; i++) {
+    int p = i;
+    for (int k = i + 1; k < n; k++) { if (fabs(a[k][i]) > fabs(a[p][i])) { p = k; } }
+    if (fabs(a[p][i]) < 1e-9) { return 0; }
+    for (int k = 0; k < n; k++) { double t = a[i][k]; a[i][k] = a[p][k]; a[p][k] = t; }
+    double t = b[i]; b[i] = b[p]; b[p] = t;
+    for (int k = i + 1; k < n; k++) {
+      double f = a[k][i] / a[i][i];
+      for (int j = i; j < n; j++) { a[k][j] -= f * a[i][j]; } b[k] -= f * b[i];
+    }
+  }
+  for (int i = n - 1; i >= 0; i--) {
+    for (int j = i + 1; j < n; j++) { b[i] -= a[i][j] * b[j]; } b[i] /= a[i][i];
+  } return 1;
+}
+
+// Estimate how much a metric grows with each request of every route, by least squares over the changes
+// between the samples in the given range. Each interval puts more weight on a different route, which
+// keeps them apart. Returns 0 if there aren't enough samples for it.
+int sk_attribute(int m, int from, int to, double *per_req)
+{
+  double a[LG_ROUTES][LG_ROUTES] = { { 0 } }, b[LG_ROUTES] = { 0 };
+  int cols[LG_ROUTES], n = 0, used = 0;
+  for (int r = 0; r < LG_ROUTES; r++) {
+    per_req[r] = 0;
+    if (sk_samples[to].req[r] > sk_samples[from].req[r]) { cols[n++] = r; }
+  }
+  for (int i = from + 1; i <= to; i++) {
+    double x[LG_ROUTES];
+    if (sk_samples[i].v[m] < 0 || sk_samples[i - 1].v[m] < 0) { continue; }
+    for (int j = 0; j < n; j++) { x[j] = (double)(sk_samples[i].req[cols[j]] - sk_samples[i - 1].req[cols[j]]); }
+    double d = sk_samples[i].v[m] - sk_samples[i - 1].v[m];
+    for (int j = 0; j < n; j++) {
+      for (int k = 0; k < n; k++) { a[j][k] += x[j] * x[k]; } b[j] += x[j] * d;
+    } used++;
+  }
+  if (n == 0 || used < n * 2 || !sk_solve(n, a, b)) { return 0; }
+  for (int j = 0; j < n; j++) { per_req[cols[j]] = b[j]; }
+  return 1;
+}
+
+// Report the resources growth over the soak. The first tenth of the samples is left out as warm-up, while
+// the caches, the database and the heap settle. A metric grows steadily when the smallest value of the last
+// quarter is past the largest one of the first quarter by more than its allowance, and the routes flagged
+// for it are the ones adding to it in both halves of the run, for at least a quarter of the growth.
+void sk_report()
+{
+  printf("\nSoak samples: %d every %d seconds", sk_count, INTERVAL);
+  if (sk_failed > 0) { printf(", %d failed or skipped", sk_failed); } printf(".\n");
+  int w = sk_count / 10, n = sk_count - w;
+  if (n < 8) { printf("Not enough samples to look for growth, run longer or sample more often.\n"); return; }
+
+  printf("\n%-12s %10s %10s %11s", "Metric", "Start", "End", "Per hour");
+  for (int r = 0; r < LG_ROUTES; r++) { printf(" %11s", lg_routes[r]); }
+  printf("  %s\n", "Growth (per request for the routes)");
+  int flagged = 0;
+  for (int m = 0; m < SK_METRICS; m++) {
+    const struct sample *first = &sk_samples[w], *last = &sk_samples[sk_count - 1];
+    if (first->v[m] < 0 || last->v[m] < 0) { continue; }
+    // Trend over time by least squares, and the quarters to tell steady growth from noise.
+    double st = 0, sv = 0, stt = 0, stv = 0, q1_max = -1, q4_min = -1;
+    for (int i = w; i < sk_count; i++) {
+      double t = sk_samples[i].t - first->t, v = sk_samples[i].v[m];
+      st += t; sv += v; stt += t * t; stv += t * v;
+      if (i < w + n / 4 && v > q1_max) { q1_max = v; }
+      if (i >= sk_count - n / 4 && (q4_min < 0 || v < q4_min)) { q4_min = v; }
+    }
+    double den = n * stt - st * st, slope = den > 0 ? (n * stv - st * sv) / den * 3600 : 0;
+    double allow = fmax(first->v[m] * 0.01, sk_metrics[m].min);
+    int growing = q4_min - q1_max > allow;
+
+    double all[LG_ROUTES], h1[LG_ROUTES], h2[LG_ROUTES]; int mid = w + n / 2;
+    int fit = sk_attribute(m, w, sk_count - 1, all) && sk_attribute(m, w, mid, h1) && sk_attribute(m, mid, sk_count - 1, h2);
+    char a[20], b[20], c[20], d[20];
+    printf("%-12s %10s %10s %11s", sk_metrics[m].label, sk_format(a, sizeof(a), first->v[m], sk_metrics[m].bytes),
+      sk_format(b, sizeof(b), last->v[m], sk_metrics[m].bytes), sk_format(c, sizeof(c), slope, sk_metrics[m].bytes));
+    for (int r = 0; r < LG_ROUTES; r++) {
+      if (fit) { printf(" %11s", sk_format(d, sizeof(d), all[r], sk_metrics[m].bytes)); } else { printf(" %11s", "-"); }
+    }
+    if (!growing) { printf("  stable\n"); continue; }
+    printf("  GROWING"); flagged++;
+    double growth = last->v[m] - first->v[m]; int routes = 0;
+    for (int r = 0; fit && r < LG_ROUTES; r++) {
+      double share = all[r] * (double)(last->req[r] - first->req[r]);
+      if (h1[r] > 0 && h2[r] > 0 && share >= growth * 0.25) { printf("%s %s", routes++ ? "," : ":", lg_routes[r]); }
+    } printf("\n");
+  }
+  if (flagged > 0) { printf("\n%d metrics kept growing, check the routes flagged next to them.\n", flagged); }
+  else { printf("\nNo sustained growth found.\n"); }
+}
+
+// Parse a duration in seconds, with an optional 's', 'm' or 'h' suffix.
+int duration_parse(const char *s)
+{
+  char *end; double v = strtod(s, &end);
+  if (*end == 'm') { v *= 60; } else if (*end == 'h') { v *= 3600; }
+  return (int)v;
+}
+
+void usage()
+{
+  printf("Usage: loadgen [options]\n"
+    "  -u URL      Server address (%s).\n"
+    "  -t SECONDS  Measured duration, or minutes and hours with an 'm' or 'h' suffix (%d).\n"
+    "  -c N        Connections, each with one request in flight (%d).\n"
+    "  -r RATE     Open loop: requests per second arriving regardless of the replies.\n"
+    "              Without it the load is closed loop, each connection waits for its reply.\n"
+    "  -C N        Maximum connections opened in the open-loop mode (%d).\n"
+    "  -k MS       Think time between requests in the closed-loop mode (%d).\n"
+    "  -n N        Users registered before measuring (%d).\n"
+    "  -p N        Scores posted for each user before measuring (%d).\n"
+    "  -s BYTES    Replay size (%d).\n"
+    "  -m MIX      Requests mix (GameEntry=%d,GetRanking=%d,GetReplay=%d,ScoreEntry=%d).\n"
+    "  -S SEED     Random seed.\n"
+    "  -i SECONDS  Soak mode: sample the server memory, database and replays size every given seconds,\n"
+    "              and report the ones that keep growing and the routes behind it.\n"
+    "              Needs Metrics=2 on the server, and running on the same machine.\n"
+    "  -o FILE     Write the soak samples to a CSV file.\n"
+    "  -j FILE     Replay a request journal written by the server, instead of the mix and the users setup.\n"
+    "  -x SPEED    Journal pace, times the original one, or 0 to send it as fast as the connections go (%g).\n"
+    "  -K 1        Keep the journal replay ids, for servers started from a copy of the captured data.\n",
+    URL, DURATION, CLIENTS, MAXCLIENTS, THINK, USERS, PREFILL, REPSIZE, MIX[0], MIX[1], MIX[2], MIX[3], SPEED);
+}
+
+// Parse a requests mix, given as comma separated route weights.
+int mix_parse(const char *s)
+{
+  int mix[LG_ROUTES] = { 0 };
+  while (*s) {
+    const char *eq = strchr(s, '='); int r;
+    if (eq == NULL) { return 0; }
+    for (r = 0; r < LG_OTHER; r++) {
+      if (strlen(lg_routes[r]) == (size_t)(eq - s) && strncmp(lg_routes[r], s, eq - s) == 0) { break; }
+    } if (r == LG_OTHER) { return 0; }
+    mix[r] = atoi(eq + 1);
+    s = strchr(eq, ','); if (s == NULL) { break; } s++;
+  } memcpy(MIX, mix, sizeof(MIX));
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  // Parse options.
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i], *v = i + 1 < argc ? argv[i + 1] : NULL;
+    if (a[0] != '-' || a[1] == '\0' || a[2] != '\0' || a[1] == 'h' || v == NULL) { usage(); return 1; }
+    switch (a[1]) {
+      case 'u': snprintf(URL, sizeof(URL), "%s", v); break;
+      case 't': DURATION = duration_parse(v); break;
+      case 'c': CLIENTS = atoi(v); break;
+      case 'r': RATE = atof(v); break;
+      case 'C': MAXCLIENTS = atoi(v); break;
+      case 'k': THINK = atoi(v); break;
+      case 'n': USERS = atoi(v); break;
+      case 'p': PREFILL = atoi(v); break;
+      case 's': REPSIZE = atoi(v); break;
+      case 'm': if (!mix_parse(v)) { usage(); return 1; } break;
+      case 'S': SEED = strtoull(v, NULL, 10); break;
+      case 'i': INTERVAL = atoi(v); break;
+      case 'o': snprintf(SAMPLES, sizeof(SAMPLES), "%s", v); break;
+      case 'j': snprintf(JOURNAL, sizeof(JOURNAL), "%s", v); break;
+      case 'x': SPEED = atof(v); break;
+      case 'K': KEEPIDS = atoi(v); break;
+      default: usage(); return 1;
+    } i++;
+  }
+  if (CLIENTS < 1 || USERS < 1 || REPSIZE < 1) { usage(); return 1; }
+  if (MAXCLIENTS < CLIENTS) { MAXCLIENTS = CLIENTS; }
+  if (SEED) { lg_rng ^= SEED * 0x9E3779B97F4A7C15ULL; }
+  if (JOURNAL[0] != '\0' && !jn_load(JOURNAL)) { return 1; }
+  lg_open = RATE > 0 || (JOURNAL[0] != '\0' && SPEED > 0);
+  if (SAMPLES[0] != '\0') {
+    if ((sk_csv = fopen(SAMPLES, "w")) == NULL) { printf("Couldn't create %s\n", SAMPLES); return 1; }
+    fprintf(sk_csv, "seconds");
+    for (int r = 0; r < LG_ROUTES; r++) { fprintf(sk_csv, ",%s", lg_routes[r]); }
+    for (int m = 0; m < SK_METRICS; m++) { fprintf(sk_csv, ",%s", sk_metrics[m].name); }
+    fprintf(sk_csv, "\n");
+  }
+
+  mg_log_set("0");
+  mg_mgr_init(&lg_mgr);
+  replay_init();
+  lg_clients = calloc(MAXCLIENTS, sizeof(struct client));
+  lg_nclients = CLIENTS;
+
+  // Register the users and post their first scores, then run the requests mix for the given time.
+  // Journals are replayed as they are, their own logins register the users.
+  if (JOURNAL[0] == '\0') { printf("Setting up %d users on %s...\n", USERS, URL); fflush(stdout); }
+  double t0 = 0, end = 0, next = 0, sample = 0;
+  while (lg_phase != PH_DRAIN || lg_inflight > 0 || sk_busy) {
+    mg_mgr_poll(&lg_mgr, 1);
+    double now = now_ms();
+    // Give up on the replies still missing a while after the end, counting them as errors.
+    if (lg_phase == PH_DRAIN && now > end + 10000) {
+      for (int i = 0; i < lg_nclients; i++) { cl_done(&lg_clients[i], ER_TIMEOUT, NULL); }
+      break;
+    }
+    if (lg_phase == PH_REGISTER || lg_phase == PH_PREFILL) {
+      int total = JOURNAL[0] != '\0' ? 0 : lg_phase == PH_REGISTER ? USERS : USERS * PREFILL;
+      struct client *cl;
+      while (lg_setup < total && (cl = cl_idle(now)) != NULL) {
+        req_build(cl, lg_phase == PH_REGISTER ? LG_GAMEENTRY : LG_SCOREENTRY, lg_setup % USERS);
+        lg_setup++; cl_send(cl, now);
+      }
+      // Move on once every request of this phase got its reply.
+      if (lg_setup >= total && lg_inflight == 0) {
+        lg_setup = 0; lg_phase++;
+        if (lg_phase == PH_RUN) {
+          t0 = now; end = now + DURATION * 1000.0; next = now; sample = now;
+          if (JOURNAL[0] != '\0') {
+            end = HUGE_VAL;
+            printf("Replaying %zu requests from %s, %s...\n", jn_count, JOURNAL, SPEED > 0 ? "paced" : "as fast as possible");
+          } else { printf("Running for %d seconds, %s loop...\n", DURATION, RATE > 0 ? "open" : "closed"); }
+          fflush(stdout);
+        }
+      }
+    } else if (lg_phase == PH_RUN) {
+      if (JOURNAL[0] != '\0' && jn_next == jn_count && lg_qhead == lg_qtail) { end = now; }
+      if (now >= end) {
+        lg_phase = PH_DRAIN; end = now;
+        if (INTERVAL > 0) { sk_scrape(now - t0); }
+        continue;
+      }
+      // Sample the server in the soak mode, then move half of the traffic to the next route.
+      if (INTERVAL > 0 && now >= sample) { sk_scrape(now - t0); sk_rotate(); sample += INTERVAL * 1000.0; }
+      struct client *cl;
+      if (JOURNAL[0] != '\0' && SPEED > 0) {
+        // Queue the journal requests due by now, keeping their spacing. A full queue holds back the rest,
+        // they're still timed from when they were due.
+        while (jn_next < jn_count && lg_qtail - lg_qhead < LG_QUEUE) {
+          double due = t0 + (jn_recs[jn_next].t - jn_recs[0].t) / SPEED;
+          if (due > now) { break; }
+          lg_queue[lg_qtail % LG_QUEUE] = due; lg_queue_rec[lg_qtail++ % LG_QUEUE] = jn_next++;
+        }
+        while (lg_qhead < lg_qtail && (cl = cl_idle(now)) != NULL) {
+          req_journal(cl, &jn_recs[lg_queue_rec[lg_qhead % LG_QUEUE]]); cl_send(cl, lg_queue[lg_qhead++ % LG_QUEUE]);
+        }
+      } else if (JOURNAL[0] != '\0') {
+        while (jn_next < jn_count && (cl = cl_idle(now)) != NULL) { req_journal(cl, &jn_recs[jn_next++]); cl_send(cl, now); }
+      } else if (RATE > 0) {
+        // Queue the arrivals due by now, exponentially spaced, and hand them to free connections.
+        while (next <= now) {
+          if (lg_qtail - lg_qhead < LG_QUEUE) { lg_queue[lg_qtail++ % LG_QUEUE] = next; } else { lg_overflow++; }
+          next += -log(1.0 - (rnd() >> 11) * (1.0 / 9007199254740992.0)) * 1000.0 / RATE;
+        }
+        while (lg_qhead < lg_qtail && (cl = cl_idle(now)) != NULL) {
+          req_build(cl, route_pick(), rnd_int(USERS)); cl_send(cl, lg_queue[lg_qhead++ % LG_QUEUE]);
+        }
+      } else {
+        while ((cl = cl_idle(now)) != NULL) { req_build(cl, route_pick(), rnd_int(USERS)); cl_send(cl, now); }
+      }
+    }
+  }
+
+  // Show the results for each route.
+  double secs = (end - t0) / 1000.0;
+  struct hist all = { 0 };
+  printf("\n%-12s %10s %8s %10s %8s %10s %10s %10s %10s\n", "Route", "Requests", "Errors", "Req/s", "MB/s", "p50 ms", "p99 ms", "p999 ms", "Max ms");
+  for (int r = 0; r <= LG_ROUTES; r++) {
+    struct hist *h = r < LG_ROUTES ? &lg_hist[r] : &all;
+    if (r < LG_ROUTES) {
+      all.count += h->count; all.errors += h->errors; all.bytes += h->bytes;
+      if (h->max > all.max) { all.max = h->max; }
+      for (int i = 0; i < H_BUCKETS; i++) { all.bucket[i] += h->bucket[i]; }
+    }
+    if (h->count == 0 && h->errors == 0) { continue; }
+    printf("%-12s %10llu %8llu %10.1f %8.1f %10.3f %10.3f %10.3f %10.3f\n", r < LG_ROUTES ? lg_routes[r] : "Total",
+      h->count, h->errors, h->count / secs, h->bytes / secs / (1 << 20), h_percentile(h, 50), h_percentile(h, 99), h_percentile(h, 99.9), h->max);
+  }
+  // Break the errors down, the latencies above only cover the successful requests.
+  if (all.errors > 0) {
+    char name[30];
+    printf("\n%-21s", "Errors");
+    for (int r = 0; r < LG_ROUTES; r++) { if (lg_hist[r].errors > 0) { printf(" %11s", lg_routes[r]); } }
+    printf("\n");
+    for (int i = 0; i < lg_nerrs; i++) {
+      printf("%-21s", err_name(name, sizeof(name), lg_errs[i].status));
+      for (int r = 0; r < LG_ROUTES; r++) { if (lg_hist[r].errors > 0) { printf(" %11llu", lg_errs[i].count[r]); } }
+      printf("\n");
+    }
+    if (all.errors > all.count) {
+      printf("\nWARNING: %.1f%% of the requests failed, the results above don't measure the server work.\n"
+        "Status 429 comes from the server rate limits, ReadRate and WriteRate have to be 0 for benchmarks.\n",
+        all.errors * 100.0 / (all.errors + all.count));
+    }
+  }
+  if (RATE > 0) {
+    printf("\nOffered %.1f req/s with up to %d connections", RATE, lg_nclients);
+    if (lg_overflow > 0) { printf(", %llu arrivals dropped with the queue full", lg_overflow); } printf(".\n");
+  }
+  if (JOURNAL[0] != '\0') {
+    printf("\nReplayed %zu requests captured over %.1f seconds", jn_count, (jn_recs[jn_count - 1].t - jn_recs[0].t) / 1000.0);
+    if (SPEED > 0) { printf(", at %gx their pace with up to %d connections", SPEED, lg_nclients); } printf(".\n");
+  }
+  if (INTERVAL > 0) { sk_report(); }
+  if (sk_csv != NULL) { fclose(sk_csv); }
+
+  mg_mgr_free(&lg_mgr);
+  for (int i = 0; i < MAXCLIENTS; i++) { free(lg_clients[i].req); }
+  free(lg_clients); free(lg_replay); free(sk_samples); free(jn_recs); free(jn_data);
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,340 @@
+// Storage benchmark. Builds synthetic databases and times the database helpers and the ranking
+// and score handlers in-process, calling the game handlers directly without HTTP or sockets. Results are written as JSON so builds can be compared.
+// Run with -h to see the options.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "../jm.h"
+#include "../mjson/mjson.h"
+
+// Benchmark options.
+static char SIZES[100] = "10000,100000,1000000";
+static char LAYOUTS[10] = "0,1";
+static char DATADIR[MAX_PATH] = "bench-data";
+static char OUTPUT[MAX_PATH] = "";
+static int BUDGET = 1000;
+static int REPSIZE = 16 * 1024;
+
+// Users in the current database, and the synthetic replay posted with the score entries.
+static int bn_users = 0;
+static char *bn_replay;
+// Approximate size of a ranking in the database, counting its global row and its share of the user object.
+#define BN_RECORD 320
+
+// Global ranking rows of the current database, loaded once for the field extraction benchmarks.
+#define BN_ROWS 1000
+static struct arena bn_rows_arena;
+static char **bn_rows; static int *bn_rows_len, bn_rows_count = 0, bn_row = 0;
+static double bn_sink;
+
+// Rankings table rows for the formatting benchmarks, with ids and times as long as real ones.
+static struct rank_row bn_fmt[BN_ROWS];
+static char bn_fmt_ids[BN_ROWS][2][18];
+
+// Fill a new database with users and their scores, spread evenly across the modes.
+// Users have one score per mode, or ten with multiple scores enabled, so their personal rankings are full.
+void bn_fill(int n)
+{
+  int per_user = MULTISCORES ? 30 : 3, made = 0;
+  bn_users = (n + per_user - 1) / per_user;
+  MDB_txn *t; mdb_txn_begin(env, NULL, 0, &t);
+  for (int u = 0; u < bn_users; u++) {
+    struct q_score q = { 0 };
+    snprintf(q.id, sizeof(q.id), "bn%06d", u);
+    struct sbuf user = { .a = &req_arena }; int count = 0;
+    sb_str(&user, "{\"id\":\""); sb_str(&user, q.id); sb_str(&user, "\",\"pass\":\"pw\",\"count\":");
+    size_t count_ofs = user.len; sb_str(&user, "  ,\"rankings\":[");
+    for (int k = 0; k < per_user && made < n; k++, made++, count++) {
+      q.mode = k % 3; q.score = rand() % 1000000; q.jewel = rand() % 1000;
+      q.level = 1 + rand() % 50; q.class = 100 + rand() % 30; q.time = 3600 + rand() % 200000;
+      // Global ranking entry, keyed by user and mode like the score entries.
+      char r_id[18], key[40]; random_num(r_id);
+      snprintf(key, sizeof(key), "%s%lld", q.id, q.mode);
+      struct sbuf r = { .a = &req_arena }; sb_score(&r, r_id, &q);
+      MDB_val k_val = { strlen(key), key }, r_val = { r.len, r.buf };
+      mdb_put(t, dbi_ranking, &k_val, &r_val, 0);
+      // Personal ranking entry.
+      if (count > 0) { sb_char(&user, ','); } sb_score(&user, NULL, &q);
+    } sb_str(&user, "]}");
+    // The count is patched into the room left for it, JSON allows the extra spaces.
+    char num[4]; snprintf(num, sizeof(num), "%d", count);
+    memcpy(user.buf + count_ofs, num, strlen(num));
+    MDB_val u_key = { strlen(q.id), q.id }, u_val = { user.len, user.buf };
+    mdb_put(t, dbi_user, &u_key, &u_val, 0);
+    ar_reset(&req_arena);
+    // Commit in batches, to keep the dirty pages list of each transaction small.
+    if (u % 2000 == 1999) { mdb_txn_commit(t); mdb_txn_begin(env, NULL, 0, &t); }
+  } mdb_txn_commit(t);
+}
+
+// Drop a handler reply and everything the request allocated.
+void bn_done(struct reply *r)
+{
+  reply_free(r); ar_reset(&req_arena);
+}
+
+// Pick a random user from the database.
+const char *bn_user()
+{
+  static char id[17];
+  snprintf(id, sizeof(id), "bn%06d", rand() % bn_users);
+  return id;
+}
+
+// Benchmarked operations.
+void op_db_get()
+{
+  char **res; int len;
+  db_get(&req_arena, dbi_ranking, "", &res, &len); ar_reset(&req_arena);
+}
+
+void op_db_get_one()
+{
+  db_get_one(&req_arena, dbi_user, (char *)bn_user()); ar_reset(&req_arena);
+}
+
+void op_db_put()
+{
+  // A key of its own, so the benchmark doesn't change the data the other operations read.
+  static char val[400];
+  if (val[0] == '\0') { memset(val, 'x', sizeof(val) - 1); }
+  db_put(dbi_user, "bench-put", val);
+}
+
+void op_ranking_global()
+{
+  struct q_ranking q = { "", rand() % 3, -1 }; struct reply r;
+  reply_init(&r, NULL, NULL); jm_get_ranking(&q, &r); bn_done(&r);
+}
+
+void op_ranking_user()
+{
+  struct q_ranking q = { "", rand() % 3, -1 }; struct reply r;
+  snprintf(q.id, sizeof(q.id), "%s", bn_user());
+  reply_init(&r, NULL, NULL); jm_get_ranking(&q, &r); bn_done(&r);
+}
+
+void op_ranking_personal()
+{
+  struct q_ranking q = { "", rand() % 3, 0 }; struct reply r;
+  snprintf(q.id, sizeof(q.id), "%s", bn_user());
+  reply_init(&r, NULL, NULL); jm_get_ranking(&q, &r); bn_done(&r);
+}
+
+void op_score_entry()
+{
+  struct q_score q = { "", rand() % 3, rand() % 1000000, rand() % 1000, 1 + rand() % 50, 100 + rand() % 30, 3600 + rand() % 200000 };
+  struct reply r;
+  snprintf(q.id, sizeof(q.id), "%s", bn_user());
+  reply_init(&r, NULL, NULL); jm_score_entry(&q, bn_replay, REPSIZE, &r); bn_done(&r);
+}
+
+// Extract the fields of a ranking row the way the handlers did before, one path lookup each.
+void op_rows_get_each()
+{
+  for (int k = 0; k < BN_ROWS; k++, bn_row = (bn_row + 1) % bn_rows_count) {
+    const char *row = bn_rows[bn_row]; int len = bn_rows_len[bn_row];
+    char r__id[30]; char r_id[20]; double r_score, r_level, r_class, r_time, r_jewel;
+    mjson_get_string(row, len, "$._id", r__id, sizeof(r__id));
+    mjson_get_string(row, len, "$.id", r_id, sizeof(r_id));
+    mjson_get_number(row, len, "$.score", &r_score);
+    mjson_get_number(row, len, "$.level", &r_level);
+    mjson_get_number(row, len, "$.class", &r_class);
+    mjson_get_number(row, len, "$.time", &r_time);
+    mjson_get_number(row, len, "$.jewel", &r_jewel);
+    bn_sink += r_score + r_level + r_class + r_time + r_jewel + r__id[0] + r_id[0];
+  }
+}
+
+// Extract the same fields in a single pass, like the ranking handlers do now.
+void op_rows_get_many()
+{
+  for (int k = 0; k < BN_ROWS; k++, bn_row = (bn_row + 1) % bn_rows_count) {
+    const char *row = bn_rows[bn_row]; int len = bn_rows_len[bn_row];
+    char r__id[30]; char r_id[20]; long long r_score, r_level, r_class, r_time, r_jewel;
+    struct mjson_field f[] = {
+      { "$._id", MJSON_TOK_STRING, r__id, sizeof(r__id) }, { "$.id", MJSON_TOK_STRING, r_id, sizeof(r_id) },
+      { "$.score", MJSON_FIELD_I64, &r_score }, { "$.level", MJSON_FIELD_I64, &r_level },
+      { "$.class", MJSON_FIELD_I64, &r_class }, { "$.time", MJSON_FIELD_I64, &r_time },
+      { "$.jewel", MJSON_FIELD_I64, &r_jewel }
+    };
+    mjson_get_many(row, len, f, 7);
+    bn_sink += r_score + r_level + r_class + r_time + r_jewel + r__id[0] + r_id[0];
+  }
+}
+
+// Format rankings table rows with snprintf, the way the handlers first did.
+void op_rows_format_snprintf()
+{
+  struct sbuf b = { .a = &req_arena };
+  for (int k = 0; k < BN_ROWS; k++) {
+    const struct rank_row *r = &bn_fmt[k]; char r_str[200];
+    int n = snprintf(r_str, sizeof(r_str), "%lld\n%s\n%s\n%lld\n0\n%lld\n%lld\n%lld\n%lld\n%d",
+      r->idx, r->_id, r->id, r->score, r->level, r->class, r->time, r->jewel, r->lit);
+    if (b.len > 0) { sb_char(&b, '.'); } sb_add(&b, r_str, n);
+  }
+  bn_sink += b.len; ar_reset(&req_arena);
+}
+
+// Format them one field at a time with the string builder.
+void op_rows_format_fields()
+{
+  struct sbuf b = { .a = &req_arena };
+  for (int k = 0; k < BN_ROWS; k++) {
+    const struct rank_row *r = &bn_fmt[k];
+    if (b.len > 0) { sb_char(&b, '.'); }
+    sb_int(&b, r->idx); sb_char(&b, '\n');
+    sb_str(&b, r->_id); sb_char(&b, '\n');
+    sb_str(&b, r->id); sb_char(&b, '\n');
+    sb_int(&b, r->score); sb_str(&b, "\n0\n");
+    sb_int(&b, r->level); sb_char(&b, '\n');
+    sb_int(&b, r->class); sb_char(&b, '\n');
+    sb_int(&b, r->time); sb_char(&b, '\n');
+    sb_int(&b, r->jewel); sb_char(&b, '\n'); sb_int(&b, r->lit);
+  }
+  bn_sink += b.len; ar_reset(&req_arena);
+}
+
+// Format them with the row formatter the handlers use.
+void op_rows_format_row()
+{
+  struct sbuf b = { .a = &req_arena };
+  for (int k = 0; k < BN_ROWS; k++) { sb_rank_row(&b, &bn_fmt[k]); }
+  bn_sink += b.len; ar_reset(&req_arena);
+}
+
+// Operations handling several rows per call report their throughput in rows too.
+struct bn_op { const char *name; void (*fn)(); int rows; };
+static const struct bn_op bn_ops[] = {
+  { "db_get", op_db_get },
+  { "db_get_one", op_db_get_one },
+  { "db_put", op_db_put },
+  { "get_ranking_global", op_ranking_global },
+  { "get_ranking_user_page", op_ranking_user },
+  { "get_ranking_personal", op_ranking_personal },
+  { "score_entry", op_score_entry },
+  { "rows_get_each", op_rows_get_each, BN_ROWS },
+  { "rows_get_many", op_rows_get_many, BN_ROWS },
+  { "rows_format_snprintf", op_rows_format_snprintf, BN_ROWS },
+  { "rows_format_fields", op_rows_format_fields, BN_ROWS },
+  { "rows_format_row", op_rows_format_row, BN_ROWS },
+};
+
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Run an operation for the time budget, at least 3 times, and write its results.
+#define BN_SAMPLES 100000
+void bn_run(FILE *out, const struct bn_op *op, int n, int first)
+{
+  static double samples[BN_SAMPLES];
+  int count = 0; double total = 0;
+  op->fn(); // Warm up.
+  while (count < BN_SAMPLES && (count < 3 || total < BUDGET)) {
+    double t = now_ms(); op->fn(); t = now_ms() - t;
+    samples[count++] = t; total += t;
+  }
+  qsort(samples, count, sizeof(double), cmp_double);
+  fprintf(out, "%s\n    { \"rankings\": %d, \"multiscores\": %d, \"op\": \"%s\", \"iterations\": %d, \"ops_per_sec\": %.1f, "
+    "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f", first ? "" : ",",
+    n, MULTISCORES, op->name, count, count * 1000.0 / total, total * 1000.0 / count,
+    samples[count / 2] * 1000.0, samples[(int)(count * 0.99)] * 1000.0, samples[count - 1] * 1000.0);
+  if (op->rows > 0) { fprintf(out, ", \"rows_per_sec\": %.1f", (double)count * op->rows * 1000.0 / total); }
+  fprintf(out, " }");
+  fflush(out);
+}
+
+void usage()
+{
+  printf("Usage: storage [options]\n"
+    "  -n SIZES    Rankings in each database, comma separated (%s).\n"
+    "  -m LAYOUTS  MultiScores layouts, comma separated (%s).\n"
+    "  -d DIR      Directory for the databases, kept between runs (%s).\n"
+    "  -t MS       Time spent on each operation (%d).\n"
+    "  -s BYTES    Replay size for the score entries (%d).\n"
+    "  -o FILE     Write the results to a file instead of the console.\n", SIZES, LAYOUTS, DATADIR, BUDGET, REPSIZE);
+}
+
+int main(int argc, char *argv[])
+{
+  // Parse options.
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i], *v = i + 1 < argc ? argv[i + 1] : NULL;
+    if (a[0] != '-' || a[1] == '\0' || a[2] != '\0' || a[1] == 'h' || v == NULL) { usage(); return 1; }
+    switch (a[1]) {
+      case 'n': snprintf(SIZES, sizeof(SIZES), "%s", v); break;
+      case 'm': snprintf(LAYOUTS, sizeof(LAYOUTS), "%s", v); break;
+      case 'd': snprintf(DATADIR, sizeof(DATADIR), "%s", v); break;
+      case 't': BUDGET = atoi(v); break;
+      case 's': REPSIZE = atoi(v); break;
+      case 'o': snprintf(OUTPUT, sizeof(OUTPUT), "%s", v); break;
+      default: usage(); return 1;
+    } i++;
+  }
+  FILE *out = OUTPUT[0] ? fopen(OUTPUT, "w") : stdout;
+  if (out == NULL) { fprintf(stderr, "Couldn't create %s\n", OUTPUT); return 1; }
+
+  // Handlers run synchronously and quietly, the same way on every build.
+  ASYNCIO = 0; LOGLEVEL = LOG_ERROR; srand(1);
+  bn_replay = malloc(REPSIZE);
+  for (int i = 0; i < REPSIZE;) {
+    char v = (char)(rand() % 16); int run = 1 + rand() % 24;
+    while (run-- > 0 && i < REPSIZE) { bn_replay[i++] = v; }
+  }
+  for (int k = 0; k < BN_ROWS; k++) {
+    random_num(bn_fmt_ids[k][0]); snprintf(bn_fmt_ids[k][1], 18, "bn%06d", rand() % 100000);
+    bn_fmt[k] = (struct rank_row){ k / 10, bn_fmt_ids[k][0], bn_fmt_ids[k][1], rand() % 1000000, 1 + rand() % 50,
+      100 + rand() % 30, 1600000000000000LL + rand(), rand() % 1000, k % 10 == 0 };
+  }
+
+  char dir[MAX_PATH], base[MAX_PATH];
+  GetCurrentDirectory(MAX_PATH, dir);
+  // Relative data directories are kept under the current one, since it changes while building each database.
+  int absolute = DATADIR[0] == '\\' || DATADIR[0] == '/' || (DATADIR[0] != '\0' && DATADIR[1] == ':');
+  if (absolute) { snprintf(base, MAX_PATH, "%s", DATADIR); } else { snprintf(base, MAX_PATH, "%s\\%s", dir, DATADIR); }
+  CreateDirectory(base, NULL);
+  fprintf(out, "{\n  \"results\": ["); int first = 1;
+  for (const char *l = LAYOUTS; *l; l += strcspn(l, ","), l += *l == ',') {
+    for (const char *s = SIZES; *s; s += strcspn(s, ","), s += *s == ',') {
+      int n = atoi(s); MULTISCORES = atoi(l);
+      if (n <= 0) { continue; }
+      // Each database lives in its own directory, laid out like the server one.
+      char db_dir[MAX_PATH], path[MAX_PATH];
+      snprintf(db_dir, MAX_PATH, "%s\\%d-%s", base, n, MULTISCORES ? "multi" : "single");
+      CreateDirectory(db_dir, NULL);
+      snprintf(path, MAX_PATH, "%s\\server", db_dir); CreateDirectory(path, NULL);
+      snprintf(path, MAX_PATH, "%s\\server\\db", db_dir); CreateDirectory(path, NULL);
+      snprintf(path, MAX_PATH, "%s\\server\\rep", db_dir); CreateDirectory(path, NULL);
+      snprintf(REPDIR, MAX_PATH, "%s", path);
+      SetCurrentDirectory(db_dir);
+      // Twice the expected data leaves room for the pages freed by updates, without reserving
+      // more address space than the database needs.
+      MAPSIZE = (int)((long long)n * BN_RECORD * 2 / (1024 * 1024)) + 16;
+      db_init(); pk_init();
+
+      // Reuse the database if it was already built, score entries only add a few rankings on each run.
+      MDB_stat st; MDB_txn *t; mdb_txn_begin(env, NULL, MDB_RDONLY, &t); mdb_stat(t, dbi_ranking, &st); mdb_txn_abort(t);
+      if (st.ms_entries == 0) {
+        fprintf(stderr, "Building %d rankings (MultiScores=%d)...\n", n, MULTISCORES);
+        bn_fill(n);
+      } else { bn_users = (n + (MULTISCORES ? 30 : 3) - 1) / (MULTISCORES ? 30 : 3); }
+      db_get(&bn_rows_arena, dbi_ranking, "", &bn_rows, &bn_rows_count);
+      bn_rows_len = ar_alloc(&bn_rows_arena, (bn_rows_count + 1) * sizeof(int)); bn_row = 0;
+      for (int i = 0; i < bn_rows_count; i++) { bn_rows_len[i] = strlen(bn_rows[i]); }
+
+      for (size_t i = 0; i < sizeof(bn_ops) / sizeof(bn_ops[0]); i++) {
+        fprintf(stderr, "%d rankings (MultiScores=%d): %s\n", n, MULTISCORES, bn_ops[i].name);
+        bn_run(out, &bn_ops[i], n, first); first = 0;
+      }
+      ar_reset(&bn_rows_arena); pk_close(); db_close(); SetCurrentDirectory(dir);
+    }
+  }
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout) { fclose(out); }
+  free(bn_replay);
+  return 0;
+}
\ No newline at end of file
@@ -1,2 +1,6 @@
-gcc -Os mongoose/mongoose.c mjson/mjson.c ini/ini.c server.c -static-libgcc -static-libstdc++ -lpthread -L./lmdb -llmdb -lws2_32 -o server.exe
-gcc -Os ini/ini.c hook.c -shared -static-libgcc -static-libstdc++ -lpthread -L./minhook -lminhook -lwininet -o server.dll
\ No newline at end of file
+gcc -Os mongoose/mongoose.c mjson/mjson.c ini/ini.c lz/lz.c jm.c server.c -static-libgcc -static-libstdc++ -lpthread -L./lmdb -llmdb -lws2_32 -lpsapi -o server.exe
+gcc -Os ini/ini.c hook.c -shared -static-libgcc -static-libstdc++ -lpthread -L./minhook -lminhook -lwininet -o server.dll
+gcc -Os mongoose/mongoose.c bench/loadgen.c -static-libgcc -lws2_32 -o loadgen.exe
+gcc -Os mongoose/mongoose.c bench/compare.c -static-libgcc -lws2_32 -o compare.exe
+gcc -Os bench/json.c -static-libgcc -o json.exe
+gcc -Os mjson/mjson.c lz/lz.c jm.c bench/storage.c -static-libgcc -static-libstdc++ -lpthread -L./lmdb -llmdb -o storage.exe
\ No newline at end of file
@@ -0,0 +1,1500 @@
+// Jewelry Master Server Emulator by Renzo Pigliacampo (Hipnosis), 2022.
+// Game handlers and the storage behind them, kept apart from the HTTP front end in server.c.
+#include <time.h>
+#include <math.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <windows.h>
+#include "jm.h"
+#include "lmdb/lmdb.h"
+#include "lz/lz.h"
+#include "mjson/mjson.h"
+
+// Allow unregistered users to be registered at the login screen.
+int REGISTER = 1;
+// Allow users to have mutiple scores (and replays) in the global rankings.
+// Don't change once the database has already been created, will break scores.
+// Won't work if a score doesn't make it to the player's top 10 ranking.
+int MULTISCORES = 1;
+// Maximum size in megabytes of the in-memory cache for the most requested replays, 0 disables it.
+int REPLAYCACHE = 8;
+// Compress replays stored on disk.
+int COMPRESS = 1;
+// Append replays to large pack files indexed in the database, instead of creating a file for each one.
+int PACKREPLAYS = 1;
+// Size in megabytes at which a new pack file is started.
+int PACKSIZE = 64;
+// Run replay reads and writes on worker threads, keeping the file operations off the server loop.
+int ASYNCIO = 1;
+// Number of worker threads for replay reads and writes.
+int IOTHREADS = 2;
+// Maximum size in megabytes the database can grow to, 0 keeps the LMDB default (1 MB).
+int MAPSIZE = 0;
+
+// Log level, records past it are left out.
+int LOGLEVEL = LOG_INFO;
+// Log file path, relative to the server directory. Logs are written to the console if empty.
+char LOGFILE[MAX_PATH] = "";
+
+// Database global variables.
+MDB_env *env;
+static MDB_txn *txn;
+MDB_dbi dbi_user;
+MDB_dbi dbi_ranking;
+
+// Replays directory, resolved once on start.
+char REPDIR[MAX_PATH];
+// Set while replays are being moved from the old flat directory into the sharded layout.
+atomic_int MIGRATING = 0;
+
+// Log record, copied as is into the ring buffer and formatted later by the log writer thread.
+#define LOG_TEXT 480
+struct log_rec {
+  atomic_size_t seq;
+  long long ts; int level;
+  const char *event;
+  unsigned short len; char text[LOG_TEXT];
+};
+
+// Lock-free ring buffer of log records, with multiple producers and the log writer as the only consumer.
+// Each slot sequence tells whether it's free to write (== position) or ready to read (== position + 1).
+#define LOG_SLOTS 2048
+static struct log_rec log_ring[LOG_SLOTS];
+static atomic_size_t log_head;
+static atomic_ulong log_dropped;
+static size_t log_tail = 0;
+static volatile int log_stop = 0;
+static pthread_t log_thread;
+static FILE *log_fp = NULL;
+
+// Queue a log record. Never blocks, the record is dropped if the buffer is full.
+// The event must be a static string, the text is copied and truncated to LOG_TEXT bytes.
+void log_push(int level, const char *event, const char *text, size_t len)
+{
+  if (level > LOGLEVEL) { return; }
+  size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+  for (;;) {
+    struct log_rec *r = &log_ring[pos & (LOG_SLOTS - 1)];
+    size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+    long dif = (long)(seq - pos);
+    if (dif == 0) {
+      // Claim the slot, then fill it and publish it to the writer.
+      if (!atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) { continue; }
+      FILETIME ft; GetSystemTimeAsFileTime(&ft);
+      r->ts = (long long)((((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime) - 116444736000000000ULL) / 10000;
+      r->level = level; r->event = event;
+      r->len = len > LOG_TEXT ? LOG_TEXT : (unsigned short)len;
+      memcpy(r->text, text, r->len);
+      atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+      return;
+    } else if (dif < 0) {
+      atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed); return;
+    } else { pos = atomic_load_explicit(&log_head, memory_order_relaxed); }
+  }
+}
+
+// Queue a formatted log record. Formatting happens on the calling thread, so keep it for infrequent messages.
+void log_printf(int level, const char *event, const char *fmt, ...)
+{
+  if (level > LOGLEVEL) { return; }
+  char text[LOG_TEXT]; va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(text, sizeof(text), fmt, ap);
+  va_end(ap);
+  log_push(level, event, text, len < 0 ? 0 : len);
+}
+
+// Log writer thread. Formats the queued records in batches and writes each batch at once.
+void *log_writer(void *arg)
+{
+  static char batch[64 * 1024];
+  const char *levels[] = { "", "ERROR", "INFO ", "DEBUG" };
+  for (;;) {
+    size_t n = 0; int stop = log_stop;
+    unsigned long dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    if (dropped > 0) { n += snprintf(batch, sizeof(batch), "%lu log records dropped, the buffer was full.\n", dropped); }
+    while (n + LOG_TEXT + 100 < sizeof(batch)) {
+      struct log_rec *r = &log_ring[log_tail & (LOG_SLOTS - 1)];
+      if (atomic_load_explicit(&r->seq, memory_order_acquire) != log_tail + 1) { break; }
+      time_t sec = (time_t)(r->ts / 1000); struct tm *tm = localtime(&sec);
+      n += strftime(batch + n, sizeof(batch) - n, "%Y-%m-%d %H:%M:%S", tm);
+      n += snprintf(batch + n, sizeof(batch) - n, ".%03d %s %s: %.*s", (int)(r->ts % 1000), levels[r->level], r->event, (int)r->len, r->text);
+      if (r->len == 0 || r->text[r->len - 1] != '\n') { batch[n++] = '\n'; }
+      // Release the slot for the next round of the ring.
+      atomic_store_explicit(&r->seq, log_tail + LOG_SLOTS, memory_order_release);
+      log_tail++;
+    }
+    if (n > 0) { fwrite(batch, 1, n, log_fp); fflush(log_fp); }
+    else if (stop) { break; }
+    else { Sleep(10); }
+  } return arg;
+}
+
+// Open the log output and start the log writer thread.
+void log_init(const char *dir)
+{
+  for (size_t i = 0; i < LOG_SLOTS; i++) { atomic_init(&log_ring[i].seq, i); }
+  if (strlen(LOGFILE) > 0) {
+    char path[MAX_PATH]; snprintf(path, MAX_PATH, "%s\\%s", dir, LOGFILE);
+    log_fp = fopen(path, "ab");
+  } if (log_fp == NULL) { log_fp = stdout; }
+  pthread_create(&log_thread, NULL, log_writer, NULL);
+}
+
+// Flush the queued records and stop the log writer thread.
+void log_close()
+{
+  log_stop = 1; pthread_join(log_thread, NULL);
+  if (log_fp != stdout) { fclose(log_fp); }
+}
+
+// Get a monotonic timestamp in milliseconds.
+double now_ms()
+{
+  LARGE_INTEGER t, f;
+  QueryPerformanceCounter(&t); QueryPerformanceFrequency(&f);
+  return (double)t.QuadPart * 1000.0 / (double)f.QuadPart;
+}
+
+// Arena blocks size, and how much of them is kept on reset.
+#define AR_BLOCK (64 * 1024)
+#define AR_KEEP (1024 * 1024)
+struct arena req_arena;
+
+// Allocate memory from the arena, aligned to 8 bytes. It's only released on the next reset.
+void *ar_alloc(struct arena *a, size_t n)
+{
+  n = (n + 7) & ~(size_t)7; a->allocs++;
+  // Use the next kept blocks with enough room before allocating a new one.
+  while (a->cur != NULL && a->cur->used + n > a->cur->size && a->cur->next != NULL) { a->cur = a->cur->next; }
+  if (a->cur == NULL || a->cur->used + n > a->cur->size) {
+    size_t size = n > AR_BLOCK ? n : AR_BLOCK;
+    struct ar_block *b = malloc(sizeof(struct ar_block) + size);
+    b->next = NULL; b->size = size; b->used = 0; a->size += size;
+    if (a->cur != NULL) { b->next = a->cur->next; a->cur->next = b; } else { a->head = b; }
+    a->cur = b;
+  }
+  char *p = (char *)a->cur->data + a->cur->used;
+  a->cur->used += n; return p;
+}
+
+// Copy a string into the arena, null-terminating it.
+char *ar_strndup(struct arena *a, const char *s, size_t n)
+{
+  char *d = ar_alloc(a, n + 1);
+  memcpy(d, s, n); d[n] = '\0';
+  return d;
+}
+
+// Release everything allocated from the arena. Blocks past the first megabyte are given back to the heap.
+void ar_reset(struct arena *a)
+{
+  size_t kept = 0;
+  for (struct ar_block *b = a->head, *prev = NULL; b != NULL;) {
+    struct ar_block *next = b->next;
+    if (prev != NULL && kept + b->size > AR_KEEP) {
+      prev->next = next; a->size -= b->size; free(b);
+    } else { b->used = 0; kept += b->size; prev = b; }
+    b = next;
+  } a->cur = a->head;
+}
+
+// Make room for the given amount of bytes, at least doubling the buffer size.
+void sb_grow(struct sbuf *b, size_t n)
+{
+  if (b->len + n + 1 <= b->size) { return; }
+  size_t size = b->size ? b->size * 2 : 256;
+  while (size < b->len + n + 1) { size *= 2; }
+  if (b->a != NULL) {
+    char *buf = ar_alloc(b->a, size);
+    if (b->len > 0) { memcpy(buf, b->buf, b->len + 1); }
+    b->buf = buf;
+  } else { b->buf = realloc(b->buf, size); }
+  b->size = size;
+}
+
+// Append bytes to the buffer.
+void sb_add(struct sbuf *b, const char *s, size_t n)
+{
+  sb_grow(b, n); memcpy(b->buf + b->len, s, n);
+  b->len += n; b->buf[b->len] = '\0';
+}
+
+// Append a null-terminated string to the buffer.
+void sb_str(struct sbuf *b, const char *s)
+{
+  sb_add(b, s, strlen(s));
+}
+
+// Append a single character to the buffer.
+void sb_char(struct sbuf *b, char ch)
+{
+  sb_grow(b, 1); b->buf[b->len++] = ch; b->buf[b->len] = '\0';
+}
+
+// Every pair of decimal digits, so integers are written two digits per division.
+static const char fmt_digits[] =
+  "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+  "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+static const unsigned long long fmt_pow10[20] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL,
+  10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+  10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+// Write an integer at the given address, without going through printf. Returns its length, at most 20 bytes.
+int fmt_int(char *p, long long v)
+{
+  int neg = v < 0, n = 1;
+  unsigned long long u = neg ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+  if (neg) { *p++ = '-'; }
+  // The length is known upfront, so the digits go straight into place from the end.
+  while (n < 20 && u >= fmt_pow10[n]) { n++; }
+  char *d = p + n;
+  while (u >= 100) { const char *t = fmt_digits + (u % 100) * 2; u /= 100; *--d = t[1]; *--d = t[0]; }
+  if (u >= 10) { *--d = fmt_digits[u * 2 + 1]; *--d = fmt_digits[u * 2]; } else { *--d = '0' + (char)u; }
+  return n + neg;
+}
+
+// Append an integer to the buffer.
+void sb_int(struct sbuf *b, long long v)
+{
+  sb_grow(b, 20); b->len += fmt_int(b->buf + b->len, v); b->buf[b->len] = '\0';
+}
+
+// Append formatted text to the buffer. Prefer the functions above in loops.
+void sb_printf(struct sbuf *b, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (n < 0) { return; }
+  sb_grow(b, n);
+  va_start(ap, fmt);
+  vsnprintf(b->buf + b->len, n + 1, fmt, ap);
+  va_end(ap);
+  b->len += n;
+}
+
+
+// Free the builder buffer, unless it's in an arena.
+void sb_free(struct sbuf *b)
+{
+  if (b->a == NULL) { free(b->buf); } b->buf = NULL; b->len = b->size = b->clen = 0;
+}
+
+// Storage metrics, read by the front end. Counters are atomic so they can be updated from any thread without locking.
+const char *mt_db_ops[MT_DB_OPS] = { "get", "get_one", "put" };
+struct mt_hist mt_db_txn[MT_DB_OPS], mt_db_commit;
+atomic_ullong mt_rep_read, mt_rep_written;
+
+// Add a duration in milliseconds to a histogram.
+void mt_observe(struct mt_hist *h, double ms)
+{
+  unsigned long long us = ms > 0 ? (unsigned long long)(ms * 1000.0) : 0;
+  int b = 0;
+  while (b < MT_BUCKETS && us >= (16ULL << b)) { b++; }
+  atomic_fetch_add_explicit(&h->bucket[b], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+// Traced phase of a request, with its timestamp and duration in milliseconds.
+struct tr_span { const char *name; double ts, dur; unsigned long req; };
+
+// Per-thread spans buffer, linked on first use so all of them can be written together.
+// The lock is only ever contended while writing the trace file.
+#define TR_SPANS 8192
+struct tr_buf {
+  pthread_mutex_t lock; int tid, len, main;
+  struct tr_span spans[TR_SPANS];
+  struct tr_buf *next;
+};
+static struct tr_buf *tr_bufs = NULL;
+static pthread_mutex_t tr_lock = PTHREAD_MUTEX_INITIALIZER;
+static int tr_tids = 0; static atomic_ulong tr_dropped;
+static pthread_t tr_main;
+// Number of the request traced on this thread, 0 if it isn't traced.
+_Thread_local unsigned long tr_req = 0;
+static _Thread_local struct tr_buf *tr_local = NULL;
+
+// Mark the calling thread as the server one in the trace files.
+void tr_init()
+{
+  tr_main = pthread_self();
+}
+
+// Get the start time of a span, 0 if the current request isn't traced.
+double tr_begin()
+{
+  return tr_req ? now_ms() : 0;
+}
+
+// Record a span started with tr_begin(). Names must be static strings.
+void tr_end(const char *name, double t)
+{
+  if (!tr_req) { return; }
+  double e = now_ms();
+  if (tr_local == NULL) {
+    tr_local = calloc(1, sizeof(struct tr_buf));
+    pthread_mutex_init(&tr_local->lock, NULL);
+    pthread_mutex_lock(&tr_lock);
+    tr_local->main = pthread_equal(pthread_self(), tr_main);
+    tr_local->tid = ++tr_tids; tr_local->next = tr_bufs; tr_bufs = tr_local;
+    pthread_mutex_unlock(&tr_lock);
+  }
+  pthread_mutex_lock(&tr_local->lock);
+  if (tr_local->len < TR_SPANS) {
+    struct tr_span *sp = &tr_local->spans[tr_local->len++];
+    sp->name = name; sp->ts = t; sp->dur = e - t; sp->req = tr_req;
+  } else { atomic_fetch_add_explicit(&tr_dropped, 1, memory_order_relaxed); }
+  pthread_mutex_unlock(&tr_local->lock);
+}
+
+// Write the recorded spans to a trace file and clear the buffers.
+// Returns the number of spans written, or -1 if the file can't be created.
+int tr_dump(const char *path)
+{
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) { return -1; }
+  int n = 0;
+  fprintf(fp, "{\"traceEvents\":[");
+  pthread_mutex_lock(&tr_lock);
+  for (struct tr_buf *b = tr_bufs; b != NULL; b = b->next) {
+    pthread_mutex_lock(&b->lock);
+    fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+      b != tr_bufs ? "," : "", b->tid, b->main ? "server" : "worker");
+    for (int i = 0; i < b->len; i++) {
+      struct tr_span *sp = &b->spans[i];
+      fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"request\":%lu}}",
+        sp->name, sp->ts * 1000.0, sp->dur * 1000.0, b->tid, sp->req);
+    } n += b->len; b->len = 0;
+    pthread_mutex_unlock(&b->lock);
+  } pthread_mutex_unlock(&tr_lock);
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(fp);
+  unsigned long dropped = atomic_exchange(&tr_dropped, 0);
+  if (dropped > 0) { log_printf(LOG_INFO, "Trace", "%lu spans dropped, the buffers were full.", dropped); }
+  return n;
+}
+
+void db_init()
+{
+  // Initialize environment.
+  mdb_env_create(&env);
+  mdb_env_set_maxdbs(env, 5);
+  if (MAPSIZE > 0) { mdb_env_set_mapsize(env, (size_t)MAPSIZE * 1024 * 1024); }
+  mdb_env_open(env, "./server/db", 0, 0664);
+
+  // Initialize databases.
+  mdb_txn_begin(env, NULL, 0, &txn);
+  mdb_dbi_open(txn, "user", MDB_CREATE, &dbi_user);
+  mdb_dbi_open(txn, "ranking", MULTISCORES ? (MDB_CREATE | MDB_DUPSORT) : MDB_CREATE, &dbi_ranking);
+  mdb_txn_commit(txn);
+}
+
+void db_close()
+{
+  // Close database connections and environment.
+  mdb_dbi_close(env, dbi_user);
+  mdb_dbi_close(env, dbi_ranking);
+  mdb_env_close(env);
+}
+
+// Get the elements from the database matching the given key, or all of them if none is specified.
+// Stores the array of values and its length back to the param adresses, allocated from the given arena.
+void db_get(struct arena *a, MDB_dbi dbi, char *_key, char ***res, int *len)
+{
+  // Initialize entry values.
+  MDB_cursor *cur;
+  MDB_val key, val;
+  val.mv_size = 0;
+  val.mv_data = NULL;
+  if (strlen(_key) > 0) {
+    key.mv_size = strlen(_key);
+    key.mv_data = _key;
+  } else {
+    key.mv_size = 0;
+    key.mv_data = NULL;
+  }
+
+  // Get items from the selected database matching the query key.
+  // Stores the results values and length back to the param adresses.
+  int i = 0; double t = now_ms(), t_tr = tr_begin();
+  mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+  // The entries count gives the size of the values array right away.
+  MDB_stat st; mdb_stat(txn, dbi, &st);
+  *res = ar_alloc(a, (st.ms_entries + 1) * sizeof(char *));
+  mdb_cursor_open(txn, dbi, &cur);
+  while (i < (int)st.ms_entries && (mdb_cursor_get(cur, &key, &val, MDB_NEXT)) == 0) {
+    // Copy the value as a valid string.
+    (*res)[i] = ar_strndup(a, (char *)val.mv_data, val.mv_size);
+    i++;
+  } *len = i;
+  mdb_cursor_close(cur);
+  mdb_txn_abort(txn);
+  mt_observe(&mt_db_txn[MT_DB_GET], now_ms() - t);
+  tr_end("db_get", t_tr);
+}
+
+// Get a single (first) element from the database matching the given key.
+// Returns a pointer to the char array, allocated from the given arena. It's empty if there's no match.
+char *db_get_one(struct arena *a, MDB_dbi dbi, char *_key)
+{
+  // Initialize entry values.
+  MDB_val key, val;
+  key.mv_size = strlen(_key);
+  key.mv_data = _key;
+  val.mv_size = 0;
+  val.mv_data = NULL;
+
+  // Get an item from the selected database.
+  double t = now_ms(), t_tr = tr_begin();
+  mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+  mdb_get(txn, dbi, &key, &val);
+  // Make sure the value is a valid string, copying it while the transaction is still open.
+  char *buf = ar_strndup(a, (char *)val.mv_data, val.mv_size);
+  mdb_txn_abort(txn);
+  mt_observe(&mt_db_txn[MT_DB_GET_ONE], now_ms() - t);
+  tr_end("db_get_one", t_tr);
+  return buf;
+}
+
+// Store a new key/value entry into the database, or update an already existing one.
+void db_put(MDB_dbi dbi, char *_key, char *_val)
+{
+  // Initialize entry values.
+  MDB_val key, val;
+  key.mv_size = strlen(_key);
+  key.mv_data = _key;
+  val.mv_size = strlen(_val);
+  val.mv_data = _val;
+
+  // Store/update entry in database. Errors are logged, a full map means the MapSize option needs raising.
+  double t = now_ms(), t_tr = tr_begin();
+  int rc = mdb_txn_begin(env, NULL, 0, &txn);
+  if (rc == 0 && (rc = mdb_put(txn, dbi, &key, &val, 0)) != 0) { mdb_txn_abort(txn); }
+  double t_c = now_ms();
+  if (rc == 0) { rc = mdb_txn_commit(txn); }
+  if (rc != 0) { log_printf(LOG_ERROR, "Database", "Couldn't store %s: %s", _key, mdb_strerror(rc)); }
+  double t_e = now_ms();
+  mt_observe(&mt_db_commit, t_e - t_c);
+  mt_observe(&mt_db_txn[MT_DB_PUT], t_e - t);
+  if (tr_req) { tr_end("db_commit", t_c); tr_end("db_put", t_tr); }
+}
+
+// Sort given elements in ascending order.
+int cmp_asc(const void *a, const void *b)
+{
+  const char *_a = *(const char **)a;
+  const char *_b = *(const char **)b;
+
+  long long buf_a = 0, buf_b = 0;
+  mjson_get_i64(_a, strlen(_a), "$.score", &buf_a);
+  mjson_get_i64(_b, strlen(_b), "$.score", &buf_b);
+
+  // Compared rather than subtracted, 64-bit scores can overflow an int.
+  return (buf_b > buf_a) - (buf_b < buf_a);
+}
+
+// Sort given elements in descending order.
+int cmp_des(const void *a, const void *b)
+{
+  const char *_a = *(const char **)a;
+  const char *_b = *(const char **)b;
+
+  long long buf_a = 0, buf_b = 0;
+  mjson_get_i64(_a, strlen(_a), "$.score", &buf_a);
+  mjson_get_i64(_b, strlen(_b), "$.score", &buf_b);
+
+  return (buf_a > buf_b) - (buf_a < buf_b);
+}
+
+// Get fixed length random number.
+char *random_num(char *buf)
+{
+  for (int i = 0; i < 16; i++) {
+    buf[i] = (rand() % 10) + '0';
+  } buf[16] = '\0'; return buf;
+}
+
+// Start an empty 200 reply, with its body built in the request arena.
+// Replies deferred to the worker threads are finished later by calling 'done' from io_complete().
+void reply_init(struct reply *r, void (*done)(struct reply *r), void *ctx)
+{
+  memset(r, 0, offsetof(struct reply, hbuf));
+  r->status = 200; r->done = done; r->ctx = ctx; r->t = now_ms();
+  r->out = (struct sbuf){ .a = &req_arena };
+  r->body = NULL; r->len = 0; r->owned = NULL; r->file[0] = '\0';
+}
+
+// Release the body owned by a reply, once it's sent.
+void reply_free(struct reply *r)
+{
+  free(r->owned); r->owned = NULL;
+}
+
+// Authenticate user. Used for login, getting rankings and starting games.
+// Response: '1': Auth error | '10': Connection error | ?: Version error.
+// Params: 'game', 'id', 'pass', 'ver'.
+void jm_game_entry(const struct q_login *q, struct reply *r)
+{
+  // Get selected user from database.
+  char *user = db_get_one(&req_arena, dbi_user, (char *)q->id);
+  // Check if user exists and the credentials are correct.
+  if (strlen(user) > 0) {
+    // Get password value from user object.
+    char u_pass[18];
+    mjson_get_string(user, strlen(user), "$.pass", u_pass, sizeof(u_pass));
+    if (strcmp(q->pass, u_pass) != 0) { sb_char(&r->out, '1'); }
+  // Check for users with the same id and create a new one if allowed.
+  } else if (strlen(q->id) > 0 && REGISTER) {
+    // Store new user into the database.
+    struct sbuf u = { .a = &req_arena };
+    sb_str(&u, "{\"id\":\""); sb_str(&u, q->id); sb_str(&u, "\",\"pass\":\""); sb_str(&u, q->pass);
+    sb_str(&u, "\",\"count\":0,\"rankings\":[]}");
+    db_put(dbi_user, (char *)q->id, u.buf);
+  // An user with this id already exists or wrong user id or password.
+  } else { sb_char(&r->out, '1'); }
+}
+
+// Walk the objects of a user rankings array in a single pass. Start with 'ofs' at 0.
+// Stores the span of the next object and returns 1, or returns 0 after the last one.
+int rank_next(const char *arr, int len, int *ofs, int *voff, int *vlen)
+{
+  int i = *ofs == 0 ? 1 : *ofs;
+  while (i < len && (arr[i] == ',' || arr[i] == ' ' || arr[i] == '\t' || arr[i] == '\r' || arr[i] == '\n')) { i++; }
+  if (i >= len || arr[i] != '{') { return 0; }
+  int n = mjson(arr + i, len - i, NULL, NULL);
+  if (n <= 0) { return 0; }
+  *voff = i; *vlen = n; *ofs = i + n;
+  return 1;
+}
+
+// Append a row to a rankings table, as "idx\n_id\nid\nscore\n0\nlevel\nclass\ntime\njewel\nlit".
+// Rows after the first one are separated by a dot. Room for the whole row is made once and it's written in place.
+void sb_rank_row(struct sbuf *b, const struct rank_row *r)
+{
+  size_t _id_len = strlen(r->_id), id_len = strlen(r->id);
+  sb_grow(b, _id_len + id_len + 7 * 20 + 13);
+  char *p = b->buf + b->len;
+  if (b->len > 0) { *p++ = '.'; }
+  p += fmt_int(p, r->idx); *p++ = '\n';
+  memcpy(p, r->_id, _id_len); p += _id_len; *p++ = '\n';
+  memcpy(p, r->id, id_len); p += id_len; *p++ = '\n';
+  p += fmt_int(p, r->score); memcpy(p, "\n0\n", 3); p += 3;
+  p += fmt_int(p, r->level); *p++ = '\n';
+  p += fmt_int(p, r->class); *p++ = '\n';
+  p += fmt_int(p, r->time); *p++ = '\n';
+  p += fmt_int(p, r->jewel); *p++ = '\n';
+  *p++ = r->lit ? '1' : '0';
+  *p = '\0'; b->len = p - b->buf;
+}
+
+// Get rankings/leaderboards data.
+// Params: 'id', 'mode', 'view'.
+void jm_get_ranking(const struct q_ranking *q, struct reply *r)
+{
+  // Manage personal rankings.
+  if (strlen(q->id) > 0 && q->view == 0) {
+    char *user = db_get_one(&req_arena, dbi_user, (char *)q->id);
+    // Get and parse user rankings array.
+    const char *u_arr; int u_arr_len = 0, ofs = 0, voff, vlen; double t = tr_begin();
+    if (mjson_find(user, strlen(user), "$.rankings", &u_arr, &u_arr_len) != MJSON_TOK_ARRAY) { u_arr_len = 0; }
+    // Store the ranking objects for the selected mode.
+    struct sbuf *u_ranks = &r->out;
+    while (rank_next(u_arr, u_arr_len, &ofs, &voff, &vlen)) {
+      // Get user ranking object values from the element alone, all of them in a single pass.
+      long long r_mode = -1, r_score = 0, r_level = 0, r_time = 0, r_jewel = 0;
+      struct mjson_field f[] = {
+        { "$.mode", MJSON_FIELD_I64, &r_mode }, { "$.score", MJSON_FIELD_I64, &r_score },
+        { "$.level", MJSON_FIELD_I64, &r_level }, { "$.time", MJSON_FIELD_I64, &r_time },
+        { "$.jewel", MJSON_FIELD_I64, &r_jewel }
+      };
+      mjson_get_many(u_arr + voff, vlen, f, 5);
+      if (r_mode == q->mode) {
+
+        // Build formatted response string. Personal rankings have no position, replay or class.
+        struct rank_row row = { 0, "0", q->id, r_score, r_level, 0, r_time, r_jewel, u_ranks->len == 0 };
+        sb_rank_row(u_ranks, &row);
+      }
+    } tr_end("personal rankings format", t);
+
+  // Manage global rankings.
+  } else {
+    char **rank; int r_len;
+    db_get(&req_arena, dbi_ranking, "", &rank, &r_len);
+
+    if (r_len > 0) {
+      // Get the ranking objects for the selected mode.
+      double t = tr_begin();
+      char **rank_mode = ar_alloc(&req_arena, r_len * sizeof(char *)); int r_mode_len = 0;
+      for (int i = 0; i < r_len; i++) {
+        long long r_mode = -1;
+        mjson_get_i64(rank[i], strlen(rank[i]), "$.mode", &r_mode);
+        if (r_mode == q->mode) { rank_mode[r_mode_len++] = rank[i]; }
+      }
+      tr_end("rankings mode filter", t);
+      // Sort results for the selected mode.
+      t = tr_begin();
+      qsort(rank_mode, (int)r_mode_len, sizeof(char *), cmp_asc);
+      tr_end("rankings sort", t); t = tr_begin();
+      // Set rankings table index, pages past the end are left empty.
+      int idx = q->view < 0 ? 0 : q->view > r_mode_len ? r_mode_len : (int)q->view;
+      if (strlen(q->id) > 0) {
+        // Get user score position table index.
+        int f = -1;
+        for (int i = 0; i < r_mode_len; i++) {
+          char r_id[20];
+          mjson_get_string(rank_mode[i], strlen(rank_mode[i]), "$.id", r_id, sizeof(r_id));
+          if (strcmp(r_id, q->id) == 0) { f = i; break; }
+        } if (f != -1) { idx = floor(f / 10); }
+      } tr_end("rankings user lookup", t);
+
+      // Fill the 10-slots scores table.
+      struct sbuf *g_ranks = &r->out; int lit_f = 0; t = tr_begin();
+      for (int i = (idx * 10); i < (idx * 10 + 10); i++) {
+        if (i >= (r_mode_len)) { break; }
+        // Get global rankings object values, in a single pass over the row.
+        char r__id[30] = ""; char r_id[20] = ""; long long r_score = 0, r_level = 0, r_class = 0, r_time = 0, r_jewel = 0;
+        struct mjson_field f[] = {
+          { "$._id", MJSON_TOK_STRING, r__id, sizeof(r__id) }, { "$.id", MJSON_TOK_STRING, r_id, sizeof(r_id) },
+          { "$.score", MJSON_FIELD_I64, &r_score }, { "$.level", MJSON_FIELD_I64, &r_level },
+          { "$.class", MJSON_FIELD_I64, &r_class }, { "$.time", MJSON_FIELD_I64, &r_time },
+          { "$.jewel", MJSON_FIELD_I64, &r_jewel }
+        };
+        mjson_get_many(rank_mode[i], strlen(rank_mode[i]), f, 7);
+
+        // Build formatted response string.
+        int lit = strcmp(r_id, q->id) == 0 && !lit_f ? 1 : 0;
+        if (strcmp(r_id, q->id) == 0) { lit_f = 1;}
+        struct rank_row row = { idx, r__id, r_id, r_score, r_level, r_class, r_time, r_jewel, lit };
+        sb_rank_row(g_ranks, &row);
+      } tr_end("rankings format", t);
+    }
+  }
+}
+
+// Replay cache entry, holding the file contents and its pre-built response headers.
+struct rep_cache {
+  char id[30], hdr[200], etag[24];
+  int hdr_len; size_t len; char *body;
+  struct rep_cache *prev, *next, *hnext;
+};
+
+// Replay cache hash table and LRU list, most recently used entries go first.
+static struct rep_cache *rc_table[256];
+static struct rep_cache *rc_head, *rc_tail;
+size_t rc_bytes = 0;
+unsigned long long rc_hits = 0, rc_misses = 0;
+
+// FNV-1a hash, used for the replay cache buckets and ETags.
+unsigned long long fnv1a(const char *buf, size_t len)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)buf[i]) * 1099511628211ULL;
+  } return h;
+}
+
+// Unlink entry from the LRU list.
+void rc_unlink(struct rep_cache *e)
+{
+  if (e->prev) { e->prev->next = e->next; } else { rc_head = e->next; }
+  if (e->next) { e->next->prev = e->prev; } else { rc_tail = e->prev; }
+  e->prev = e->next = NULL;
+}
+
+// Link entry at the front of the LRU list.
+void rc_link(struct rep_cache *e)
+{
+  e->prev = NULL; e->next = rc_head;
+  if (rc_head) { rc_head->prev = e; } else { rc_tail = e; }
+  rc_head = e;
+}
+
+// Get the cached entry for the given replay id, marking it as the most recently used.
+struct rep_cache *rc_find(const char *id)
+{
+  struct rep_cache *e = rc_table[fnv1a(id, strlen(id)) & 255];
+  while (e && strcmp(e->id, id) != 0) { e = e->hnext; }
+  if (e && e != rc_head) { rc_unlink(e); rc_link(e); }
+  return e;
+}
+
+// Drop a replay from the cache. Must be called whenever a replay file is replaced or deleted.
+void rc_remove(const char *id)
+{
+  struct rep_cache **p = &rc_table[fnv1a(id, strlen(id)) & 255];
+  while (*p && strcmp((*p)->id, id) != 0) { p = &(*p)->hnext; }
+  if (*p == NULL) { return; }
+  struct rep_cache *e = *p; *p = e->hnext;
+  rc_unlink(e); rc_bytes -= e->len;
+  free(e->body); free(e);
+}
+
+// Build the response headers for a replay loaded in memory, with an ETag based on its contents.
+// Returns the headers length.
+int rep_header(char *hdr, size_t hdr_size, char *etag, size_t etag_size, const char *body, size_t len)
+{
+  snprintf(etag, etag_size, "\"%016llx\"", fnv1a(body, len));
+  return snprintf(hdr, hdr_size, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\nEtag: %s\r\nContent-Length: %llu\r\n\r\n", etag, (unsigned long long)len);
+}
+
+// Reply to a conditional request for a replay the client already has.
+void rep_not_modified(const char *etag, struct reply *r)
+{
+  r->status = 304; r->hdr = r->hbuf; r->body = NULL; r->len = 0;
+  r->hdr_len = snprintf(r->hbuf, sizeof(r->hbuf), "HTTP/1.1 304 Not Modified\r\nEtag: %s\r\nContent-Length: 0\r\n\r\n", etag);
+}
+
+// Store a replay into the cache, evicting the least recently used entries to make room for it.
+// Returns the new entry, or NULL if the replay is too big to be cached.
+struct rep_cache *rc_insert(const char *id, const char *body, size_t len)
+{
+  size_t max = (size_t)REPLAYCACHE * 1024 * 1024;
+  if (strlen(id) >= sizeof(((struct rep_cache *)0)->id) || len > max / 4) { return NULL; }
+  rc_remove(id);
+  while (rc_tail && rc_bytes + len > max) { rc_remove(rc_tail->id); }
+
+  // Copy replay contents and build the response headers once.
+  struct rep_cache *e = calloc(1, sizeof(struct rep_cache));
+  e->body = malloc(len + 1); e->len = len;
+  memcpy(e->body, body, len); strcpy(e->id, id);
+  e->hdr_len = rep_header(e->hdr, sizeof(e->hdr), e->etag, sizeof(e->etag), body, len);
+
+  // Add entry to the hash table and the front of the LRU list.
+  struct rep_cache **b = &rc_table[fnv1a(id, strlen(id)) & 255];
+  e->hnext = *b; *b = e;
+  rc_link(e); rc_bytes += len;
+  return e;
+}
+
+// Reply with a cached replay, answering conditional requests with its ETag.
+// The body is only valid until the cache changes, so the reply has to be sent right away.
+void rc_reply(struct rep_cache *e, const char *inm, struct reply *r)
+{
+  if (inm != NULL && strcmp(inm, e->etag) == 0) { rep_not_modified(e->etag, r); }
+  else { r->hdr = e->hdr; r->hdr_len = e->hdr_len; r->body = e->body; r->len = e->len; }
+}
+
+// Reply with a replay loaded in memory, which stays owned by the caller, or with a 304 if the client has it already.
+void rep_reply(const char *buf, size_t len, const char *inm, struct reply *r)
+{
+  char etag[24];
+  r->hdr = r->hbuf; r->hdr_len = rep_header(r->hbuf, sizeof(r->hbuf), etag, sizeof(etag), buf, len);
+  if (inm != NULL && strcmp(inm, etag) == 0) { rep_not_modified(etag, r); }
+  else { r->body = buf; r->len = len; }
+}
+
+// Replays compression statistics, to weigh the disk savings against the CPU cost.
+static unsigned long long rz_count = 0, rz_raw = 0, rz_packed = 0, rz_inflates = 0;
+static double rz_deflate_ms = 0, rz_inflate_ms = 0;
+static pthread_mutex_t rz_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Copy the compression statistics, which the worker threads update while storing replays.
+void rz_get_stats(struct rz_stats *st)
+{
+  pthread_mutex_lock(&rz_lock);
+  st->count = rz_count; st->raw = rz_raw; st->packed = rz_packed; st->inflates = rz_inflates;
+  st->deflate_ms = rz_deflate_ms; st->inflate_ms = rz_inflate_ms;
+  pthread_mutex_unlock(&rz_lock);
+}
+
+// Build the path of a replay file, either raw ('rep') or compressed ('rez').
+// Replays are spread in two levels of subdirectories named after the id hash, like 'rep\\3f\\a0\\<id>.rep'.
+void rep_path(char *buf, const char *id, const char *ext)
+{
+  unsigned long long h = fnv1a(id, strlen(id));
+  snprintf(buf, MAX_PATH, "%s\\%02x\\%02x\\%s.%s", REPDIR, (int)(h & 255), (int)((h >> 8) & 255), id, ext);
+}
+
+// Build the path of a replay file in the old flat layout.
+void rep_flat_path(char *buf, const char *id, const char *ext)
+{
+  snprintf(buf, MAX_PATH, "%s\\%s.%s", REPDIR, id, ext);
+}
+
+// Create the shard directories for the given replay id.
+// Created directories are remembered to avoid the extra syscalls on every write. The worker threads
+// and the migration share the bitmap, creating a directory twice is harmless.
+void rep_mkdir(const char *id)
+{
+  static _Atomic unsigned char made[65536 / 8];
+  unsigned long long h = fnv1a(id, strlen(id)); int s = (int)(h & 65535);
+  if (atomic_load(&made[s / 8]) & (1 << (s % 8))) { return; }
+  char r_dir[MAX_PATH];
+  snprintf(r_dir, MAX_PATH, "%s\\%02x", REPDIR, (int)(h & 255)); CreateDirectory(r_dir, NULL);
+  snprintf(r_dir, MAX_PATH, "%s\\%02x\\%02x", REPDIR, (int)(h & 255), (int)((h >> 8) & 255)); CreateDirectory(r_dir, NULL);
+  atomic_fetch_or(&made[s / 8], 1 << (s % 8));
+}
+
+// Find an existing replay file, looking into the flat layout while the migration is running.
+// Returns 0 if it doesn't exist, leaving the sharded path in the buffer.
+int rep_find(char *buf, const char *id, const char *ext)
+{
+  rep_path(buf, id, ext);
+  if (GetFileAttributesA(buf) != INVALID_FILE_ATTRIBUTES) { return 1; }
+  if (MIGRATING) {
+    char flat[MAX_PATH]; rep_flat_path(flat, id, ext);
+    if (GetFileAttributesA(flat) != INVALID_FILE_ATTRIBUTES) { strcpy(buf, flat); return 1; }
+    // Check again in case the file has been moved in the meantime.
+    return GetFileAttributesA(buf) != INVALID_FILE_ATTRIBUTES;
+  } return 0;
+}
+
+// Move replays from the old flat directory into the sharded layout.
+// Runs on its own thread on start, lookups fall back to the old paths until it's done.
+void *rep_migrate(void *arg)
+{
+  char pattern[MAX_PATH]; int moved = 0;
+  WIN32_FIND_DATAA fd;
+  snprintf(pattern, MAX_PATH, "%s\\*.re?", REPDIR);
+  HANDLE h = FindFirstFileA(pattern, &fd);
+  if (h != INVALID_HANDLE_VALUE) {
+    do {
+      char *ext = strrchr(fd.cFileName, '.');
+      if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || !ext || (strcmp(ext, ".rep") != 0 && strcmp(ext, ".rez") != 0)) { continue; }
+      char id[MAX_PATH], from[MAX_PATH], to[MAX_PATH];
+      snprintf(id, MAX_PATH, "%.*s", (int)(ext - fd.cFileName), fd.cFileName);
+      snprintf(from, MAX_PATH, "%s\\%s", REPDIR, fd.cFileName);
+      rep_path(to, id, ext + 1); rep_mkdir(id);
+      if (MoveFileA(from, to)) { moved++; }
+      // A replay already in the sharded layout has been written after the flat one.
+      else if (GetFileAttributesA(to) != INVALID_FILE_ATTRIBUTES) { remove(from); }
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+  }
+  if (moved > 0) { log_printf(LOG_INFO, "Migration", "%d replay files moved to the sharded layout.", moved); }
+  MIGRATING = 0; return arg;
+}
+
+// Read a whole file into memory. Returns NULL if it doesn't exist or is empty.
+// Remember to free the return value.
+char *read_file(const char *path, size_t *len)
+{
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) { return NULL; }
+  fseek(fp, 0, SEEK_END); long n = ftell(fp); fseek(fp, 0, SEEK_SET);
+  char *buf = n > 0 ? malloc(n) : NULL;
+  if (buf && fread(buf, 1, n, fp) != (size_t)n) { free(buf); buf = NULL; }
+  fclose(fp); *len = n > 0 ? n : 0;
+  return buf;
+}
+
+// Inflate a compressed replay. Returns NULL if the data is corrupt.
+// Compressed replays start with the 'JMLZ' magic and the original length as a 32-bit little endian value.
+char *rz_inflate(const char *z, size_t z_len, size_t *len)
+{
+  if (z_len <= 8 || memcmp(z, "JMLZ", 4) != 0) { return NULL; }
+  double t = now_ms(); const unsigned char *h = (const unsigned char *)z;
+  size_t raw = h[4] | (h[5] << 8) | (h[6] << 16) | ((size_t)h[7] << 24);
+  char *buf = malloc(raw + 1);
+  if (raw == 0 || lz_decompress(z + 8, z_len - 8, buf, raw) != raw) { free(buf); return NULL; }
+  *len = raw; t = now_ms() - t;
+  pthread_mutex_lock(&rz_lock); rz_inflates++; rz_inflate_ms += t; pthread_mutex_unlock(&rz_lock);
+  return buf;
+}
+
+// Read and inflate a compressed replay file. Returns NULL if there's no valid compressed file for the id.
+char *rz_read(const char *id, size_t *len)
+{
+  char r_file[MAX_PATH]; size_t z_len;
+  char *z = rep_find(r_file, id, "rez") ? read_file(r_file, &z_len) : NULL;
+  char *buf = z != NULL ? rz_inflate(z, z_len, len) : NULL;
+  free(z); return buf;
+}
+
+// Pack files index entry, stored by replay id in its own environment next to the pack files. Writing it
+// doesn't hold up the server loop, and the index is backed up along with the files it points into.
+struct pack_rec {
+  unsigned int seg, len, sum, flags;
+  unsigned long long ofs;
+};
+#define PACK_COMPRESSED 1
+
+// Map size of the pack files index, room for about 900 thousand replays.
+#define PK_MAPSIZE 64
+// Pack files state. The lock guards the active pack file and the index updates.
+static pthread_mutex_t pk_lock = PTHREAD_MUTEX_INITIALIZER;
+static MDB_env *pk_env = NULL;
+static MDB_dbi pk_dbi;
+static FILE *pk_fp = NULL;
+static unsigned int pk_seg = 0;
+static unsigned long long pk_size = 0;
+
+// Build the path of the given pack file.
+void pk_path(char *buf, unsigned int seg)
+{
+  snprintf(buf, MAX_PATH, "%s\\pack\\%06u.pak", REPDIR, seg);
+}
+
+// Get the index entry for the given replay id. Returns 0 if it isn't packed.
+int pk_get(const char *id, struct pack_rec *r)
+{
+  MDB_txn *t; MDB_val key, val; int found = 0;
+  key.mv_size = strlen(id); key.mv_data = (void *)id;
+  if (pk_env == NULL || mdb_txn_begin(pk_env, NULL, MDB_RDONLY, &t) != 0) { return 0; }
+  if (mdb_get(t, pk_dbi, &key, &val) == 0 && val.mv_size == sizeof(*r)) {
+    memcpy(r, val.mv_data, sizeof(*r)); found = 1;
+  } mdb_txn_abort(t);
+  return found;
+}
+
+// Append a replay to the active pack file and point its index entry to it.
+// The active pack file is rolled over once it reaches the maximum size. Must be called with the lock held.
+int pk_append(const char *id, const char *buf, size_t len, unsigned int flags)
+{
+  char path[MAX_PATH];
+  if (pk_fp != NULL && pk_size >= (unsigned long long)PACKSIZE * 1024 * 1024) {
+    fclose(pk_fp); pk_fp = NULL; pk_seg++;
+  }
+  if (pk_fp == NULL) {
+    pk_path(path, pk_seg);
+    if ((pk_fp = fopen(path, "ab")) == NULL) { return 0; }
+    fseek(pk_fp, 0, SEEK_END); pk_size = ftell(pk_fp);
+  }
+  // Reopen the pack file on failure, so its size is taken again from disk.
+  struct pack_rec r = { pk_seg, (unsigned int)len, (unsigned int)fnv1a(buf, len), flags, pk_size };
+  if (fwrite(buf, 1, len, pk_fp) != len || fflush(pk_fp) != 0) {
+    log_printf(LOG_ERROR, "Replays", "Couldn't write to pack file %06u.", pk_seg);
+    fclose(pk_fp); pk_fp = NULL; return 0;
+  } pk_size += len;
+
+  // Update replay index entry. The replay is left as dead space if that fails.
+  MDB_txn *t; MDB_val key, val;
+  key.mv_size = strlen(id); key.mv_data = (void *)id;
+  val.mv_size = sizeof(r); val.mv_data = &r;
+  int rc = mdb_txn_begin(pk_env, NULL, 0, &t);
+  if (rc == 0 && (rc = mdb_put(t, pk_dbi, &key, &val, 0)) != 0) { mdb_txn_abort(t); }
+  if (rc == 0) { rc = mdb_txn_commit(t); }
+  if (rc != 0) { log_printf(LOG_ERROR, "Replays", "Couldn't index packed replay %s: %s", id, mdb_strerror(rc)); }
+  return rc == 0;
+}
+
+// Store a replay into the pack files. Previous versions are left as dead space for the compactor.
+int pk_write(const char *id, const char *buf, size_t len, unsigned int flags)
+{
+  if (pk_env == NULL) { return 0; }
+  pthread_mutex_lock(&pk_lock);
+  int res = pk_append(id, buf, len, flags);
+  pthread_mutex_unlock(&pk_lock);
+  return res;
+}
+
+// Read the packed bytes of a replay, as stored. Returns NULL if the pack file is gone or the bytes don't match
+// the checksum, after being moved by the compactor. PackSize is capped so offsets fit in a long.
+char *pk_read_rec(const struct pack_rec *r)
+{
+  char path[MAX_PATH]; pk_path(path, r->seg);
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) { return NULL; }
+  char *buf = malloc(r->len + 1);
+  if (fseek(fp, (long)r->ofs, SEEK_SET) != 0 || fread(buf, 1, r->len, fp) != r->len ||
+    (unsigned int)fnv1a(buf, r->len) != r->sum) { free(buf); buf = NULL; }
+  fclose(fp); return buf;
+}
+
+// Read a packed replay, inflating it if needed. Returns NULL if it isn't packed.
+// The file is read without the lock, looking the entry up again if the compactor moved it meanwhile.
+// Remember to free the return value.
+char *pk_read(const char *id, size_t *len)
+{
+  struct pack_rec r, prev; char *rec = NULL;
+  for (int i = 0; i < 2 && rec == NULL; i++) {
+    if (!pk_get(id, &r) || (i > 0 && r.seg == prev.seg && r.ofs == prev.ofs)) { break; }
+    rec = pk_read_rec(&r); prev = r;
+  } if (rec == NULL) { return NULL; }
+  if (!(r.flags & PACK_COMPRESSED)) { *len = r.len; return rec; }
+  char *buf = rz_inflate(rec, r.len, len);
+  free(rec); return buf;
+}
+
+// Delete the index entry of a packed replay.
+void pk_remove(const char *id)
+{
+  MDB_txn *t; MDB_val key;
+  key.mv_size = strlen(id); key.mv_data = (void *)id;
+  if (pk_env == NULL) { return; }
+  pthread_mutex_lock(&pk_lock);
+  int rc = mdb_txn_begin(pk_env, NULL, 0, &t);
+  if (rc == 0 && (rc = mdb_del(t, pk_dbi, &key, NULL)) != 0) { mdb_txn_abort(t); }
+  if (rc == 0) { rc = mdb_txn_commit(t); }
+  if (rc != 0 && rc != MDB_NOTFOUND) { log_printf(LOG_ERROR, "Replays", "Couldn't unindex packed replay %s: %s", id, mdb_strerror(rc)); }
+  pthread_mutex_unlock(&pk_lock);
+}
+
+// Compactor thread state. It sleeps on the condition between passes, so it can be woken up to stop on exit.
+static pthread_t pk_thread;
+static pthread_mutex_t pk_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pk_wait_cond = PTHREAD_COND_INITIALIZER;
+static volatile int pk_stop = 0;
+
+// Rewrite pack files that are mostly made of dead replays, left by replaced or deleted scores.
+// Live replays are appended to the active pack file and the old file is deleted.
+void pk_compact()
+{
+  MDB_txn *t; MDB_cursor *cur; MDB_val key, val; struct pack_rec r;
+  if (pk_env == NULL) { return; }
+  pthread_mutex_lock(&pk_lock);
+  unsigned int segs = pk_seg;
+  pthread_mutex_unlock(&pk_lock);
+
+  // Add up live bytes for each pack file.
+  unsigned long long *live = calloc(segs + 1, sizeof(unsigned long long));
+  mdb_txn_begin(pk_env, NULL, MDB_RDONLY, &t);
+  mdb_cursor_open(t, pk_dbi, &cur);
+  while (mdb_cursor_get(cur, &key, &val, MDB_NEXT) == 0) {
+    memcpy(&r, val.mv_data, sizeof(r));
+    if (r.seg < segs) { live[r.seg] += r.len; }
+  } mdb_cursor_close(cur); mdb_txn_abort(t);
+
+  // Compact the pack files, other than the active one, with more than half of dead space.
+  for (unsigned int seg = 0; seg < segs; seg++) {
+    // Stop between files when the server is closing, the one being moved is always finished.
+    if (pk_stop) { break; }
+    char path[MAX_PATH]; struct stat st;
+    pk_path(path, seg);
+    if (stat(path, &st) != 0 || live[seg] * 2 > (unsigned long long)st.st_size) { continue; }
+
+    // Collect replay ids still stored in the pack file.
+    char **ids = NULL; int n = 0;
+    mdb_txn_begin(pk_env, NULL, MDB_RDONLY, &t);
+    mdb_cursor_open(t, pk_dbi, &cur);
+    while (mdb_cursor_get(cur, &key, &val, MDB_NEXT) == 0) {
+      memcpy(&r, val.mv_data, sizeof(r));
+      if (r.seg != seg) { continue; }
+      ids = realloc(ids, (n + 1) * sizeof(char *));
+      ids[n] = calloc(key.mv_size + 1, sizeof(char));
+      memcpy(ids[n++], key.mv_data, key.mv_size);
+    } mdb_cursor_close(cur); mdb_txn_abort(t);
+
+    // Move them one by one, skipping replays replaced or deleted in the meantime.
+    // They're read without the lock, which only covers checking the entry again and appending them.
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+      char *rec = NULL; struct pack_rec now;
+      if (pk_get(ids[i], &r) && r.seg == seg && (rec = pk_read_rec(&r)) == NULL) { ok = 0; }
+      pthread_mutex_lock(&pk_lock);
+      if (rec != NULL && pk_get(ids[i], &now) && now.seg == r.seg && now.ofs == r.ofs &&
+        !pk_append(ids[i], rec, r.len, r.flags)) { ok = 0; }
+      pthread_mutex_unlock(&pk_lock);
+      free(rec); free(ids[i]);
+    } free(ids);
+
+    if (ok) {
+      pthread_mutex_lock(&pk_lock);
+      remove(path);
+      pthread_mutex_unlock(&pk_lock);
+      log_printf(LOG_INFO, "Compaction", "Pack file %06u rewritten, %llu bytes reclaimed.", seg, (unsigned long long)st.st_size - live[seg]);
+    }
+  } free(live);
+}
+
+// Background compaction loop, checks the pack files every 10 minutes until it's stopped.
+void *pk_compactor(void *arg)
+{
+  pthread_mutex_lock(&pk_wait_lock);
+  while (!pk_stop) {
+    struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts); ts.tv_sec += 10 * 60;
+    pthread_cond_timedwait(&pk_wait_cond, &pk_wait_lock, &ts);
+    if (pk_stop) { break; }
+    pthread_mutex_unlock(&pk_wait_lock); pk_compact();
+    pthread_mutex_lock(&pk_wait_lock);
+  } pthread_mutex_unlock(&pk_wait_lock);
+  return arg;
+}
+
+// Start the compactor thread.
+void pk_start()
+{
+  pthread_create(&pk_thread, NULL, pk_compactor, NULL);
+}
+
+// Wake the compactor up and wait for it to finish, so the database and pack files can be closed.
+void pk_join()
+{
+  pthread_mutex_lock(&pk_wait_lock);
+  pk_stop = 1; pthread_cond_signal(&pk_wait_cond);
+  pthread_mutex_unlock(&pk_wait_lock);
+  pthread_join(pk_thread, NULL);
+}
+
+// Close the active pack file and forget it, so another replays directory can be opened with pk_init().
+void pk_close()
+{
+  pthread_mutex_lock(&pk_lock);
+  if (pk_fp != NULL) { fclose(pk_fp); pk_fp = NULL; }
+  if (pk_env != NULL) { mdb_dbi_close(pk_env, pk_dbi); mdb_env_close(pk_env); pk_env = NULL; }
+  pk_seg = 0; pk_size = 0;
+  pthread_mutex_unlock(&pk_lock);
+}
+
+// Create the pack files directory, open its index and find the active pack file, the one with the highest number.
+void pk_init()
+{
+  char path[MAX_PATH], pattern[MAX_PATH]; MDB_txn *t;
+  WIN32_FIND_DATAA fd;
+  snprintf(path, MAX_PATH, "%s\\pack", REPDIR);
+  CreateDirectory(path, NULL);
+  int rc = mdb_env_create(&pk_env);
+  if (rc == 0) { mdb_env_set_mapsize(pk_env, (size_t)PK_MAPSIZE * 1024 * 1024); rc = mdb_env_open(pk_env, path, 0, 0664); }
+  if (rc == 0 && (rc = mdb_txn_begin(pk_env, NULL, 0, &t)) == 0) {
+    if ((rc = mdb_dbi_open(t, NULL, 0, &pk_dbi)) == 0) { rc = mdb_txn_commit(t); } else { mdb_txn_abort(t); }
+  }
+  if (rc != 0) {
+    log_printf(LOG_ERROR, "Replays", "Couldn't open the pack files index: %s", mdb_strerror(rc));
+    if (pk_env != NULL) { mdb_env_close(pk_env); pk_env = NULL; }
+  }
+  snprintf(pattern, MAX_PATH, "%s\\pack\\*.pak", REPDIR);
+  HANDLE h = FindFirstFileA(pattern, &fd);
+  if (h != INVALID_HANDLE_VALUE) {
+    do {
+      unsigned int seg = strtoul(fd.cFileName, NULL, 10);
+      if (seg > pk_seg) { pk_seg = seg; }
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+  }
+}
+
+// Read a replay, compressed or not. Returns NULL if it doesn't exist.
+// Remember to free the return value.
+char *rep_read(const char *id, size_t *len)
+{
+  double t = tr_begin();
+  char *buf = pk_read(id, len);
+  if (buf == NULL) { buf = rz_read(id, len); }
+  if (buf == NULL) {
+    char r_file[MAX_PATH];
+    if (rep_find(r_file, id, "rep")) { buf = read_file(r_file, len); }
+  } if (buf != NULL) { atomic_fetch_add_explicit(&mt_rep_read, *len, memory_order_relaxed); }
+  tr_end("replay read", t); return buf;
+}
+
+// Delete the replay files for the given id.
+void rep_unlink(const char *id)
+{
+  char r_file[MAX_PATH];
+  rep_path(r_file, id, "rep"); remove(r_file);
+  rep_path(r_file, id, "rez"); remove(r_file);
+  if (MIGRATING) {
+    rep_flat_path(r_file, id, "rep"); remove(r_file);
+    rep_flat_path(r_file, id, "rez"); remove(r_file);
+  }
+}
+
+
+// Store a replay for the given id, deleting the previous one if it's being replaced.
+// It's compressed if enabled, unless that doesn't make it any smaller.
+// Safe to call from the worker threads, cached replays have to be dropped by the caller.
+void rep_write(const char *id, const char *buf, size_t len, int replace)
+{
+  char r_file[MAX_PATH], *z = NULL; size_t z_len = 0;
+  if (replace) { rep_unlink(id); }
+  atomic_fetch_add_explicit(&mt_rep_written, len, memory_order_relaxed);
+  if (COMPRESS && len > 0) {
+    double t = now_ms(), t_tr = tr_begin();
+    z = malloc(8 + LZ_BOUND(len)); memcpy(z, "JMLZ", 4);
+    for (int i = 0; i < 4; i++) { z[4 + i] = (char)((len >> (i * 8)) & 255); }
+    z_len = 8 + lz_compress(buf, len, z + 8);
+    t = now_ms() - t; tr_end("replay compress", t_tr);
+    pthread_mutex_lock(&rz_lock);
+    rz_count++; rz_raw += len; rz_packed += z_len < len ? z_len : len; rz_deflate_ms += t;
+    pthread_mutex_unlock(&rz_lock);
+  }
+  int compressed = z != NULL && z_len < len;
+  if (compressed) { buf = z; len = z_len; }
+
+  // Append replay to the pack files, falling back to a single file if that fails.
+  double t = tr_begin();
+  if (PACKREPLAYS && pk_write(id, buf, len, compressed ? PACK_COMPRESSED : 0)) { tr_end("replay write", t); free(z); return; }
+  if (replace) { pk_remove(id); } rep_mkdir(id);
+  rep_path(r_file, id, compressed ? "rez" : "rep");
+  FILE *fp = fopen(r_file, "wb");
+  if (fp) { fwrite(buf, 1, len, fp); fclose(fp); }
+  else { log_printf(LOG_ERROR, "Replays", "Couldn't write replay file for %s.", id); }
+  tr_end("replay write", t); free(z);
+}
+
+// Replay read or write queued for the worker threads, with the reply it's finished with.
+struct io_job {
+  int write, replace;
+  void (*done)(struct reply *r); void *ctx; double t;
+  char id[30], inm[24], *buf; size_t len; unsigned long trace;
+  struct io_job *next;
+};
+
+// Worker threads queues. Finished jobs are handed back to the server loop, which gets woken up to complete them.
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static struct io_job *io_queue = NULL, *io_queue_tail = NULL, *io_done = NULL;
+static int io_pending = 0;
+static void (*io_wake)() = NULL;
+
+// Worker thread loop, runs queued jobs in order.
+void *io_worker(void *arg)
+{
+  for (;;) {
+    pthread_mutex_lock(&io_lock);
+    while (io_queue == NULL) { pthread_cond_wait(&io_cond, &io_lock); }
+    struct io_job *j = io_queue;
+    if ((io_queue = j->next) == NULL) { io_queue_tail = NULL; }
+    pthread_mutex_unlock(&io_lock);
+
+    tr_req = j->trace;
+    if (j->write) { rep_write(j->id, j->buf, j->len, j->replace); }
+    else { j->buf = rep_read(j->id, &j->len); }
+    tr_req = 0;
+
+    // Hand the job back and wake up the server loop.
+    pthread_mutex_lock(&io_lock);
+    j->next = io_done; io_done = j; io_pending--;
+    pthread_mutex_unlock(&io_lock);
+    io_wake();
+  } return arg;
+}
+
+// Queue a replay read or write, the deferred reply is finished once it's done.
+// The data to write and the ETag a read is validated against are copied, since the request buffer is gone by then.
+void io_submit(const struct reply *r, int write, const char *id, const char *inm, const char *buf, size_t len, int replace)
+{
+  struct io_job *j = calloc(1, sizeof(struct io_job));
+  j->write = write; j->replace = replace; j->done = r->done; j->ctx = r->ctx; j->t = r->t; j->trace = tr_req;
+  snprintf(j->id, sizeof(j->id), "%s", id);
+  if (inm != NULL && strlen(inm) < sizeof(j->inm)) { strcpy(j->inm, inm); }
+  if (write) { j->buf = malloc(len + 1); memcpy(j->buf, buf, len); j->len = len; }
+  pthread_mutex_lock(&io_lock);
+  if (io_queue_tail) { io_queue_tail->next = j; } else { io_queue = j; }
+  io_queue_tail = j; io_pending++;
+  pthread_cond_signal(&io_cond);
+  pthread_mutex_unlock(&io_lock);
+}
+
+// Finish the jobs done by the worker threads, handing their replies to the callbacks they were deferred with.
+// Must be called from the thread that runs the handlers, the replay cache isn't shared.
+void io_complete()
+{
+  pthread_mutex_lock(&io_lock);
+  struct io_job *j = io_done; io_done = NULL;
+  pthread_mutex_unlock(&io_lock);
+
+  while (j != NULL) {
+    struct io_job *next = j->next; struct reply r;
+    reply_init(&r, j->done, j->ctx); r.t = j->t;
+    tr_req = j->trace; double t = tr_begin();
+    // Score entries get an empty reply, replay reads the replay or a not found one.
+    if (!j->write && j->buf != NULL) {
+      // Prefer the cached replay, it may have been replaced while this one was being read.
+      struct rep_cache *e = REPLAYCACHE ? rc_find(j->id) : NULL;
+      if (e == NULL && REPLAYCACHE) { e = rc_insert(j->id, j->buf, j->len); }
+      const char *inm = j->inm[0] ? j->inm : NULL;
+      if (e) { rc_reply(e, inm, &r); } else { rep_reply(j->buf, j->len, inm, &r); }
+    } else if (!j->write) { r.status = 404; r.body = "Not found\n"; r.len = 10; }
+    if (r.done != NULL) { r.done(&r); }
+    tr_end(j->write ? "ScoreEntry reply" : "GetReplay reply", t); tr_req = 0;
+    free(j->buf); free(j); j = next;
+  }
+}
+
+// Start the worker threads. 'wake' is called from them whenever a job is done, to have io_complete() called.
+void io_init(void (*wake)())
+{
+  if (!ASYNCIO) { return; }
+  io_wake = wake;
+  for (int i = 0; i < IOTHREADS; i++) {
+    pthread_t worker;
+    pthread_create(&worker, NULL, io_worker, NULL);
+    pthread_detach(worker);
+  }
+}
+
+// Get the number of replays waiting for the worker threads.
+int io_queued()
+{
+  pthread_mutex_lock(&io_lock);
+  int pending = io_pending;
+  pthread_mutex_unlock(&io_lock);
+  return pending;
+}
+
+// Wait for the queued replay writes to finish before exiting.
+void io_drain()
+{
+  while (io_queued() > 0) { Sleep(10); }
+}
+
+// Store a replay on the worker threads if enabled. Returns 1 if the reply has to wait for it.
+// The replay is cached right away, so it can be requested before it reaches the disk.
+int rep_store(const struct reply *r, const char *id, const char *buf, size_t len, int replace)
+{
+  rc_remove(id);
+  if (!ASYNCIO) { rep_write(id, buf, len, replace); return 0; }
+  if (REPLAYCACHE) { rc_insert(id, buf, len); }
+  io_submit(r, 1, id, NULL, buf, len, replace);
+  return 1;
+}
+
+// Get replay for the selected score. Conditional requests are answered with the replay ETag.
+// Ranged requests skip the cache and the worker threads, and with REP_FILE the raw replay files
+// are left on disk for the caller to serve, instead of being read into the reply.
+// Params: 'id', 'mode', 'view'.
+void jm_get_replay(const struct q_replay *q, const char *inm, int flags, struct reply *r)
+{
+  // Send replay from the cache if possible.
+  int ranged = flags & REP_RANGED;
+  struct rep_cache *e = REPLAYCACHE && !ranged ? rc_find(q->id) : NULL;
+  if (e) { rc_hits++; rc_reply(e, inm, r); return; }
+  // Read replay on the worker threads, it's sent when done.
+  if (ASYNCIO && !ranged) { rc_misses++; io_submit(r, 0, q->id, inm, NULL, 0, 0); r->status = 0; return; }
+
+  // Load replay into the cache for the next requests, inflating it if it's compressed.
+  size_t len; char *buf = NULL;
+  if (REPLAYCACHE && !ranged) {
+    rc_misses++;
+    if ((buf = rep_read(q->id, &len)) != NULL && (e = rc_insert(q->id, buf, len)) != NULL) {
+      rc_reply(e, inm, r); free(buf); return;
+    }
+  // Packed and compressed replays have to be loaded in memory before sending.
+  } else if (flags & REP_FILE) {
+    if ((buf = pk_read(q->id, &len)) == NULL) { buf = rz_read(q->id, &len); }
+    if (buf != NULL) { atomic_fetch_add_explicit(&mt_rep_read, len, memory_order_relaxed); }
+  } else { buf = rep_read(q->id, &len); }
+  if (buf != NULL) { r->owned = buf; rep_reply(buf, len, inm, r); return; }
+
+  // Leave the raw replay file on disk to the caller if asked to.
+  if ((flags & REP_FILE) && rep_find(r->file, q->id, "rep")) { return; }
+  r->file[0] = '\0'; r->status = 404; r->body = "Not found\n"; r->len = 10;
+}
+
+// Build the stored score object, with its ranking id if it has one.
+void sb_score(struct sbuf *b, const char *_id, const struct q_score *q)
+{
+  sb_char(b, '{');
+  if (_id) { sb_str(b, "\"_id\":\""); sb_str(b, _id); sb_str(b, "\","); }
+  sb_str(b, "\"id\":\""); sb_str(b, q->id);
+  sb_str(b, "\",\"mode\":"); sb_int(b, q->mode);
+  sb_str(b, ",\"score\":"); sb_int(b, q->score);
+  sb_str(b, ",\"jewel\":"); sb_int(b, q->jewel);
+  sb_str(b, ",\"level\":"); sb_int(b, q->level);
+  sb_str(b, ",\"class\":"); sb_int(b, q->class);
+  sb_str(b, ",\"time\":"); sb_int(b, q->time); sb_char(b, '}');
+}
+
+// Send user score to rankings/leaderboards and replay data.
+// Params: 'id', 'mode', 'score', 'jewel', 'level', 'class', 'time'.
+void jm_score_entry(const struct q_score *qp, const char *replay, size_t replay_len, struct reply *r)
+{
+  // Generate unique identifiable key for rankings.
+  struct q_score q = *qp; char q_key[40];
+  snprintf(q_key, sizeof(q_key), "%s%lld", q.id, q.mode);
+
+  // Manage global rankings database and replays storage.
+  // The reply is delayed if the replay is being written on the worker threads.
+  double t = tr_begin();
+  char *rank = db_get_one(&req_arena, dbi_ranking, q_key); int pending = 0;
+  // Update user score entry if already present.
+  if (strlen(rank) > 0 && !MULTISCORES) {
+    // Replace only if the score is higher than the already stored.
+    long long r_score = 0;
+    mjson_get_i64(rank, strlen(rank), "$.score", &r_score);
+    if (q.score > r_score) {
+      // Update ranking entry in database.
+      char r_id[25]; struct sbuf r_str = { .a = &req_arena };
+      mjson_get_string(rank, strlen(rank), "$._id", r_id, sizeof(r_id));
+      sb_score(&r_str, r_id, &q);
+      db_put(dbi_ranking, q_key, r_str.buf);
+
+      // Replace previous replay with the new one.
+      double t_r = tr_begin();
+      pending = rep_store(r, r_id, replay, replay_len, 1);
+      tr_end("replay store", t_r);
+    }
+
+  // Add score entry if it's from a new user or multiple scores are enabled.
+  } else {
+    // Store new score entry in the rankings database.
+    char r_id[18]; random_num(r_id);
+    struct sbuf r_str = { .a = &req_arena };
+    sb_score(&r_str, r_id, &q);
+    db_put(dbi_ranking, q_key, r_str.buf);
+
+    // Store replay with the newly created id.
+    double t_r = tr_begin();
+    pending = rep_store(r, r_id, replay, replay_len, 0);
+    tr_end("replay store", t_r);
+  }
+  tr_end("global ranking update", t);
+
+  // Manage personal rankings from the users database.
+  t = tr_begin();
+  char *user = db_get_one(&req_arena, dbi_user, q.id);
+  // Get and parse user rankings object.
+  unsigned u_count = 0; double t_p = tr_begin();
+  mjson_get_u32(user, strlen(user), "$.count", &u_count);
+  // Store the ranking objects for the selected mode and the total length, with room for a new one.
+  int u_ranks_mode = 0, n = 0;
+  char **u_ranks = ar_alloc(&req_arena, ((size_t)u_count + 1) * sizeof(char *));
+  // Walk the rankings array once, reading each element on its own.
+  const char *u_arr; int u_arr_len = 0, ofs = 0, voff, vlen;
+  if (mjson_find(user, strlen(user), "$.rankings", &u_arr, &u_arr_len) != MJSON_TOK_ARRAY) { u_arr_len = 0; }
+  for (; n < (int)u_count && rank_next(u_arr, u_arr_len, &ofs, &voff, &vlen); n++) {
+    // Calculate amount of items for the selected mode.
+    long long u_rank_mode = -1;
+    mjson_get_i64(u_arr + voff, vlen, "$.mode", &u_rank_mode);
+    if (u_rank_mode == q.mode) { u_ranks_mode++; }
+
+    // Add ranking object to user rankings array for future sorting and updating.
+    u_ranks[n] = ar_strndup(&req_arena, u_arr + voff, vlen);
+  } u_count = n;
+
+  // Check if the user rankings slots are full for the selected mode.
+  if (u_ranks_mode == 10) {
+    // Sort rankings to get the smallest score for the selected mode.
+    qsort(u_ranks, u_count, sizeof(char *), cmp_des);
+    int u_ranks_sm = 0;
+    for (int i = 0; i < (int)u_count; i++) {
+      long long u_rank_mode = -1;
+      mjson_get_i64(u_ranks[i], strlen(u_ranks[i]), "$.mode", &u_rank_mode);
+      if (u_rank_mode == q.mode) {
+        u_ranks_sm = i; break;
+      }
+    }
+    // Replace only if the score is higher than the smallest stored.
+    long long u_rank_score = 0;
+    mjson_get_i64(u_ranks[u_ranks_sm], strlen(u_ranks[u_ranks_sm]), "$.score", &u_rank_score);
+    if (q.score > u_rank_score) {
+      struct sbuf r_str = { .a = &req_arena };
+      sb_score(&r_str, NULL, &q);
+      u_ranks[u_ranks_sm] = r_str.buf;
+    }
+
+  // Add new score entry to the user personal ranking.
+  } else {
+    u_count++; struct sbuf r_str = { .a = &req_arena };
+    sb_score(&r_str, NULL, &q);
+    u_ranks[u_count - 1] = r_str.buf;
+  }
+
+  // Sort the user rankings for storage, to avoid having to sort on each ranking request (and duplicate all the code from above).
+  qsort(u_ranks, u_count, sizeof(char *), cmp_asc);
+  // Build the user object string with its rankings array and update the entry on the database.
+  char u_pass[20] = ""; struct sbuf u_str = { .a = &req_arena };
+  mjson_get_string(user, strlen(user), "$.pass", u_pass, sizeof(u_pass));
+  sb_str(&u_str, "{\"id\":\""); sb_str(&u_str, q.id); sb_str(&u_str, "\",\"pass\":\""); sb_str(&u_str, u_pass);
+  sb_str(&u_str, "\",\"count\":"); sb_int(&u_str, u_count); sb_str(&u_str, ",\"rankings\":[");
+  for (int i = 0; i < (int)u_count; i++) {
+    if (i != 0) { sb_char(&u_str, ','); }
+    sb_str(&u_str, u_ranks[i]);
+  } sb_str(&u_str, "]}");
+  tr_end("personal rankings rebuild", t_p);
+  db_put(dbi_user, q.id, u_str.buf);
+  tr_end("personal ranking update", t);
+  if (pending) { r->status = 0; }
+}
\ No newline at end of file
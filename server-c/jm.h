@@ -0,0 +1,178 @@
+// Jewelry Master Server Emulator by Renzo Pigliacampo (Hipnosis), 2022.
+// Game handlers, database and replays storage, with no ties to the HTTP front end that calls them.
+#ifndef JM_H
+#define JM_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <windows.h>
+#include "lmdb/lmdb.h"
+
+// Options, loaded from 'server.ini' by the front end before anything else runs. See jm.c.
+extern int REGISTER, MULTISCORES, REPLAYCACHE, COMPRESS, PACKREPLAYS, PACKSIZE, ASYNCIO, IOTHREADS, MAPSIZE;
+// Log levels. 0: Nothing | 1: Errors | 2: Requests and server events | 3: Debug, with the whole raw requests.
+enum { LOG_NONE, LOG_ERROR, LOG_INFO, LOG_DEBUG };
+extern int LOGLEVEL;
+extern char LOGFILE[MAX_PATH];
+// Replays directory, set by the front end before opening the storage.
+extern char REPDIR[MAX_PATH];
+// Set while replays are being moved from the old flat directory into the sharded layout.
+extern atomic_int MIGRATING;
+
+// Queue a log record. Never blocks, the record is dropped if the buffer is full.
+// The event must be a static string, the text is copied and truncated.
+void log_push(int level, const char *event, const char *text, size_t len);
+// Queue a formatted log record. Formatting happens on the calling thread, so keep it for infrequent messages.
+void log_printf(int level, const char *event, const char *fmt, ...);
+// Open the log output, relative to the given directory, and start the log writer thread.
+void log_init(const char *dir);
+// Flush the queued records and stop the log writer thread.
+void log_close();
+// Get a monotonic timestamp in milliseconds.
+double now_ms();
+
+// Bump allocator for the request handlers temporaries, reset once the reply is queued.
+// Blocks are kept between requests, so after warming up a request doesn't touch the heap for them.
+struct ar_block { struct ar_block *next; size_t size, used; double data[]; };
+struct arena { struct ar_block *head, *cur; size_t size; unsigned long long allocs; };
+// Arena the game handlers allocate from. The front end resets it after each request.
+extern struct arena req_arena;
+// Allocate memory from the arena, aligned to 8 bytes. It's only released on the next reset.
+void *ar_alloc(struct arena *a, size_t n);
+// Copy a string into the arena, null-terminating it.
+char *ar_strndup(struct arena *a, const char *s, size_t n);
+// Release everything allocated from the arena. Blocks past the first megabyte are given back to the heap.
+void ar_reset(struct arena *a);
+
+// Growable string builder, always kept null-terminated. Responses are built right after their headers,
+// so the whole buffer can be handed to the connection once the body length is patched in at 'clen'.
+// Builders for temporary strings can take their memory from an arena instead of the heap.
+struct sbuf { char *buf; size_t len, size, clen; struct arena *a; };
+// Make room for the given amount of bytes, at least doubling the buffer size.
+void sb_grow(struct sbuf *b, size_t n);
+// Append bytes, a null-terminated string, a single character or an integer to the buffer.
+void sb_add(struct sbuf *b, const char *s, size_t n);
+void sb_str(struct sbuf *b, const char *s);
+void sb_char(struct sbuf *b, char ch);
+void sb_int(struct sbuf *b, long long v);
+// Append formatted text to the buffer. Prefer the functions above in loops.
+void sb_printf(struct sbuf *b, const char *fmt, ...);
+// Free the builder buffer, unless it's in an arena.
+void sb_free(struct sbuf *b);
+
+// Latency histogram with logarithmic buckets, doubling from 16 microseconds up to about half a second.
+#define MT_BUCKETS 16
+struct mt_hist {
+  atomic_ullong count, sum_us;
+  atomic_ullong bucket[MT_BUCKETS + 1];
+};
+// Storage metrics: database transactions by operation, commits, and replay bytes read and written.
+enum { MT_DB_GET, MT_DB_GET_ONE, MT_DB_PUT, MT_DB_OPS };
+extern const char *mt_db_ops[MT_DB_OPS];
+extern struct mt_hist mt_db_txn[MT_DB_OPS], mt_db_commit;
+extern atomic_ullong mt_rep_read, mt_rep_written;
+// Add a duration in milliseconds to a histogram.
+void mt_observe(struct mt_hist *h, double ms);
+
+// Number of the request traced on this thread, 0 if it isn't traced. Set by the front end for sampled requests.
+extern _Thread_local unsigned long tr_req;
+// Mark the calling thread as the server one in the trace files.
+void tr_init();
+// Get the start time of a span, 0 if the current request isn't traced.
+double tr_begin();
+// Record a span started with tr_begin(). Names must be static strings.
+void tr_end(const char *name, double t);
+// Write the recorded spans to a trace file and clear the buffers.
+// Returns the number of spans written, or -1 if the file can't be created.
+int tr_dump(const char *path);
+
+// FNV-1a hash, used for the replay cache buckets and ETags.
+unsigned long long fnv1a(const char *buf, size_t len);
+
+// Users and rankings databases, opened in './server/db' by db_init().
+extern MDB_env *env;
+extern MDB_dbi dbi_user, dbi_ranking;
+void db_init();
+void db_close();
+// Get the elements from the database matching the given key, or all of them if none is specified.
+// Stores the array of values and its length back to the param adresses, allocated from the given arena.
+void db_get(struct arena *a, MDB_dbi dbi, char *_key, char ***res, int *len);
+// Get a single (first) element from the database matching the given key, allocated from the given arena.
+// It's empty if there's no match.
+char *db_get_one(struct arena *a, MDB_dbi dbi, char *_key);
+// Store a new key/value entry into the database, or update an already existing one.
+void db_put(MDB_dbi dbi, char *_key, char *_val);
+// Get fixed length random number, used for replay ids. 'buf' must hold 17 bytes.
+char *random_num(char *buf);
+
+// Typed query parameters for each route, decoded by the front end. Missing optional parameters are left empty or 0.
+// Ids and passwords take up to 17 characters, as they always have.
+struct q_login { char id[18], pass[18]; };
+struct q_ranking { char id[18]; long long mode, view; };
+struct q_replay { char id[30]; };
+struct q_score { char id[18]; long long mode, score, jewel, level, class, time; };
+
+// Reply of a game handler, for the front end to send. The body is either built into 'out' or points to data
+// owned elsewhere, like a cached replay. Replays carry their own full header in 'hdr', and the raw files the
+// front end asked to serve itself are left in 'file'. A 0 status means the reply was deferred to the worker
+// threads, 'done' gets the finished one later with the same 'ctx', from io_complete().
+struct reply {
+  int status;
+  const char *hdr; size_t hdr_len; char hbuf[200];
+  struct sbuf out; const char *body; size_t len; char *owned;
+  char file[MAX_PATH];
+  void (*done)(struct reply *r); void *ctx; double t;
+};
+// Start an empty 200 reply, with its body built in the request arena. 'done' may be NULL if nothing's deferred.
+void reply_init(struct reply *r, void (*done)(struct reply *r), void *ctx);
+// Release the body owned by a reply, once it's sent.
+void reply_free(struct reply *r);
+
+// Game handlers.
+// Authenticate user, or register it if allowed. Replies '1' on authentication errors.
+void jm_game_entry(const struct q_login *q, struct reply *r);
+// Get the personal rankings of a user, or a page of the global ones.
+void jm_get_ranking(const struct q_ranking *q, struct reply *r);
+// Get the replay of a score, answering conditional requests with the given If-None-Match value.
+// REP_RANGED skips the cache and the worker threads, for requests of part of the replay.
+// REP_FILE leaves raw replay files on disk for the front end to serve, with their path in 'file'.
+#define REP_RANGED 1
+#define REP_FILE 2
+void jm_get_replay(const struct q_replay *q, const char *inm, int flags, struct reply *r);
+// Store a score in the global and personal rankings, along with its replay.
+void jm_score_entry(const struct q_score *q, const char *replay, size_t replay_len, struct reply *r);
+
+// A rankings table row, as the game reads it.
+struct rank_row { long long idx; const char *_id, *id; long long score, level, class, time, jewel; int lit; };
+// Append a row to a rankings table, separated by a dot from the previous ones.
+void sb_rank_row(struct sbuf *b, const struct rank_row *r);
+// Build the stored score object, with its ranking id if it has one.
+void sb_score(struct sbuf *b, const char *_id, const struct q_score *q);
+
+// Replay cache statistics. Only the thread running the handlers updates them.
+extern size_t rc_bytes;
+extern unsigned long long rc_hits, rc_misses;
+// Replays compression statistics, to weigh the disk savings against the CPU cost.
+struct rz_stats { unsigned long long count, raw, packed, inflates; double deflate_ms, inflate_ms; };
+void rz_get_stats(struct rz_stats *st);
+
+// Move replays from the old flat directory into the sharded layout. Thread function, set MIGRATING before starting it.
+void *rep_migrate(void *arg);
+// Open the pack files index and find the active pack file.
+void pk_init();
+// Start and stop the pack files compactor thread.
+void pk_start();
+void pk_join();
+// Close the active pack file and the index, so another replays directory can be opened with pk_init().
+void pk_close();
+
+// Start the replay worker threads, if enabled. They call 'wake' from their thread whenever a job is done,
+// the front end then calls io_complete() on its own to finish the deferred replies.
+void io_init(void (*wake)());
+void io_complete();
+// Get the number of replays waiting for the worker threads.
+int io_queued();
+// Wait for the queued replay writes to finish before exiting.
+void io_drain();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,112 @@
+// Jewelry Master Server Emulator by Renzo Pigliacampo (Hipnosis), 2022.
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+// Each sequence is a token byte (literals length in the high nibble and match length minus
+// LZ_MINMATCH in the low one), the literals, and a 2 bytes little endian match offset.
+// Nibbles set to 15 are followed by extra length bytes, added up until one is lower than 255.
+// The last sequence only holds literals.
+#define LZ_MINMATCH 4
+#define LZ_HASHLOG 12
+#define LZ_MAXDIST 65535
+// Leave the tail of the input as literals, so matches never read past the end.
+#define LZ_LASTLITERALS 5
+#define LZ_MFLIMIT 12
+
+static uint32_t lz_read32(const unsigned char *p)
+{
+  uint32_t v; memcpy(&v, p, 4); return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASHLOG);
+}
+
+// Write a length continuation, 255 for each full byte and the remainder.
+static unsigned char *lz_put_len(unsigned char *op, size_t len)
+{
+  while (len >= 255) { *op++ = 255; len -= 255; }
+  *op++ = (unsigned char)len; return op;
+}
+
+// Write a sequence of literals followed by an optional match.
+static unsigned char *lz_put_seq(unsigned char *op, const unsigned char *lit, size_t lit_len, size_t off, size_t match_len)
+{
+  unsigned char *token = op++;
+  size_t ml = match_len ? match_len - LZ_MINMATCH : 0;
+  *token = (unsigned char)(((lit_len >= 15 ? 15 : lit_len) << 4) | (ml >= 15 ? 15 : ml));
+  if (lit_len >= 15) { op = lz_put_len(op, lit_len - 15); }
+  memcpy(op, lit, lit_len); op += lit_len;
+  if (match_len) {
+    *op++ = (unsigned char)(off & 255);
+    *op++ = (unsigned char)(off >> 8);
+    if (ml >= 15) { op = lz_put_len(op, ml - 15); }
+  } return op;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst)
+{
+  const unsigned char *in = (const unsigned char *)src, *ip = in, *anchor = in;
+  const unsigned char *end = in + len;
+  unsigned char *op = (unsigned char *)dst;
+  uint32_t table[1 << LZ_HASHLOG] = { 0 };
+
+  // Inputs too short to hold a match are stored as a single literal run.
+  if (len > LZ_MFLIMIT) {
+    const unsigned char *mflimit = end - LZ_MFLIMIT, *matchlimit = end - LZ_LASTLITERALS;
+    ip++;
+    while (ip < mflimit) {
+      // Look for a previous occurrence of the next 4 bytes.
+      uint32_t seq = lz_read32(ip), h = lz_hash(seq);
+      const unsigned char *ref = in + table[h];
+      table[h] = (uint32_t)(ip - in);
+      if (ref >= ip || (size_t)(ip - ref) > LZ_MAXDIST || lz_read32(ref) != seq) { ip++; continue; }
+
+      // Extend the match backwards over pending literals and forward as far as possible.
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) { ip--; ref--; }
+      const unsigned char *mp = ip + LZ_MINMATCH, *mr = ref + LZ_MINMATCH;
+      while (mp < matchlimit && *mp == *mr) { mp++; mr++; }
+
+      op = lz_put_seq(op, anchor, ip - anchor, ip - ref, mp - ip);
+      ip = anchor = mp;
+      // Index a position inside the match to find overlapping repetitions faster.
+      if (ip < mflimit) { table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - in); }
+    }
+  }
+  op = lz_put_seq(op, anchor, end - anchor, 0, 0);
+  return (size_t)(op - (unsigned char *)dst);
+}
+
+size_t lz_decompress(const char *src, size_t len, char *dst, size_t dst_len)
+{
+  const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+  unsigned char *op = (unsigned char *)dst, *oend = op + dst_len;
+
+  while (ip < iend) {
+    // Copy literals.
+    unsigned int token = *ip++; size_t n = token >> 4;
+    if (n == 15) {
+      unsigned int b;
+      do { if (ip >= iend) { return 0; } b = *ip++; n += b; } while (b == 255);
+    }
+    if (n > (size_t)(iend - ip) || n > (size_t)(oend - op)) { return 0; }
+    memcpy(op, ip, n); ip += n; op += n;
+    // The last sequence has no match.
+    if (ip == iend) { break; }
+
+    // Copy match, byte by byte since it can overlap with the output being written.
+    if (iend - ip < 2) { return 0; }
+    size_t off = ip[0] | (ip[1] << 8); ip += 2;
+    n = (token & 15);
+    if (n == 15) {
+      unsigned int b;
+      do { if (ip >= iend) { return 0; } b = *ip++; n += b; } while (b == 255);
+    } n += LZ_MINMATCH;
+    if (off == 0 || off > (size_t)(op - (unsigned char *)dst) || n > (size_t)(oend - op)) { return 0; }
+    const unsigned char *ref = op - off;
+    while (n--) { *op++ = *ref++; }
+  }
+  return op == oend ? dst_len : 0;
+}
\ No newline at end of file
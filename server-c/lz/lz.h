@@ -0,0 +1,18 @@
+// Jewelry Master Server Emulator by Renzo Pigliacampo (Hipnosis), 2022.
+// Small LZ77 block codec used for replays compression at rest.
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// Worst case compressed size for an input of the given length.
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compress 'len' bytes from 'src' into 'dst', which must hold at least LZ_BOUND(len) bytes.
+// Returns the compressed length.
+size_t lz_compress(const char *src, size_t len, char *dst);
+// Decompress 'len' bytes from 'src' into 'dst', filling exactly 'dst_len' bytes.
+// Returns the decompressed length, or 0 if the input is corrupt or doesn't fit.
+size_t lz_decompress(const char *src, size_t len, char *dst, size_t dst_len);
+
+#endif
\ No newline at end of file
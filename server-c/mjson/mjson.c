@@ -20,6 +20,7 @@
 // SOFTWARE.
 
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 
 #include "mjson.h"
@@ -48,6 +49,128 @@ static int mjson_escape(int c) {
   return mjson_esc(c, 1);
 }
 
+#if MJSON_ENABLE_SIMD
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#include <immintrin.h>
+#define MJSON_CTZ(x) __builtin_ctz(x)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+static int mjson_ctz(unsigned x) {
+  unsigned long i;
+  _BitScanForward(&i, x);
+  return (int) i;
+}
+#define MJSON_CTZ(x) mjson_ctz(x)
+#endif
+
+// String bodies scanner: 0 for the byte at a time loop, 1 for SSE2 and 2 for
+// AVX2. Picked from the CPU features on first use, threads racing there all
+// store the same value. It can be set beforehand to force a slower one.
+// With GCC and Clang the vector scanners are compiled for their own target
+// only, so they also work in builds that don't enable SSE2 everywhere.
+static int mjson_simd = -1;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MJSON_ENABLE_AVX2 1
+#define MJSON_SSE2 __attribute__((target("sse2")))
+
+static void mjson_simd_init(void) {
+  __builtin_cpu_init();
+  mjson_simd = __builtin_cpu_supports("avx2")   ? 2
+               : __builtin_cpu_supports("sse2") ? 1
+                                                : 0;
+}
+
+__attribute__((target("avx2"))) static int mjson_scan_avx2(const char *s,
+                                                           int i, int len) {
+  const __m256i q = _mm256_set1_epi8('"'), b = _mm256_set1_epi8('\\');
+  const __m256i z = _mm256_setzero_si256();
+  unsigned mask = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, q), _mm256_cmpeq_epi8(v, b));
+    mask = (unsigned) _mm256_movemask_epi8(_mm256_or_si256(m, _mm256_cmpeq_epi8(v, z)));
+    if (mask != 0) break;
+  }
+  // Compilers don't always clear the upper halves on their own (GCC at -Os),
+  // and the SSE code running next would stall on them.
+  _mm256_zeroupper();
+  if (mask != 0) return i + MJSON_CTZ(mask);
+  for (; i < len; i++) {
+    if (s[i] == '"' || s[i] == '\\' || s[i] == '\0') break;
+  }
+  return i;
+}
+#else
+#define MJSON_ENABLE_AVX2 0
+#define MJSON_SSE2
+
+// MSVC only enables SIMD on targets that always have SSE2.
+static void mjson_simd_init(void) {
+  mjson_simd = 1;
+}
+#endif
+
+// Return the offset of the first quote, backslash or NUL byte at or after i,
+// or len if there is none. Loads never go past len. Most strings end within
+// the first vector, so the AVX2 scanner is only called for long ones.
+MJSON_SSE2 static int mjson_scan_sse2(const char *s, int i, int len) {
+  const __m128i q = _mm_set1_epi8('"'), b = _mm_set1_epi8('\\');
+  const __m128i z = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, b));
+    unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(m, _mm_cmpeq_epi8(v, z)));
+    if (mask != 0) return i + MJSON_CTZ(mask);
+#if MJSON_ENABLE_AVX2
+    if (mjson_simd == 2 && len - i >= 16 + 64) {
+      return mjson_scan_avx2(s, i + 16, len);
+    }
+#endif
+  }
+  for (; i < len; i++) {
+    if (s[i] == '"' || s[i] == '\\' || s[i] == '\0') break;
+  }
+  return i;
+}
+
+static int mjson_scan(const char *s, int i, int len) {
+  if (mjson_simd > 0) return mjson_scan_sse2(s, i, len);
+  for (; i < len; i++) {
+    if (s[i] == '"' || s[i] == '\\' || s[i] == '\0') break;
+  }
+  return i;
+}
+
+// Return the offset of the first byte at or after i that isn't whitespace.
+MJSON_SSE2 static int mjson_skip_space(const char *s, int i, int len) {
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+    unsigned mask = ~(unsigned) _mm_movemask_epi8(m) & 0xffff;
+    if (mask != 0) return i + MJSON_CTZ(mask);
+  }
+  for (; i < len; i++) {
+    if (s[i] != ' ' && s[i] != '\t' && s[i] != '\n' && s[i] != '\r') break;
+  }
+  return i;
+}
+
+static int mjson_pass_string(const char *s, int len) {
+  int i = 0;
+  for (;;) {
+    i = mjson_scan(s, i, len);
+    if (i >= len || s[i] == '\0') return MJSON_ERROR_INVALID_INPUT;
+    if (s[i] == '"') return i;
+    // A backslash, skip the escaped character along with it.
+    i += (i + 1 < len && mjson_escape(s[i + 1])) ? 2 : 1;
+  }
+}
+#else
 static int mjson_pass_string(const char *s, int len) {
   int i;
   for (i = 0; i < len; i++) {
@@ -61,6 +184,7 @@ static int mjson_pass_string(const char *s, int len) {
   }
   return MJSON_ERROR_INVALID_INPUT;
 }
+#endif
 
 int mjson(const char *s, int len, mjson_cb_t cb, void *ud) {
   enum { S_VALUE, S_KEY, S_COLON, S_COMMA_OR_EOO } expecting = S_VALUE;
@@ -81,11 +205,24 @@ int mjson(const char *s, int len, mjson_cb_t cb, void *ud) {
     }                                                                  \
   } while (0)
 
+#if MJSON_ENABLE_SIMD
+  if (mjson_simd < 0) mjson_simd_init();
+#endif
   for (i = 0; i < len; i++) {
     int start = i;
     unsigned char c = ((unsigned char *) s)[i];
     int tok = c;
-    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') continue;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+#if MJSON_ENABLE_SIMD
+      // Indentation comes in runs, skip them a vector at a time.
+      if (mjson_simd > 0 && i + 1 < len &&
+          (s[i + 1] == ' ' || s[i + 1] == '\t' || s[i + 1] == '\n' ||
+           s[i + 1] == '\r')) {
+        i = mjson_skip_space(s, i + 1, len) - 1;
+      }
+#endif
+      continue;
+    }
     // printf("- %c [%.*s] %d %d\n", c, i, s, depth, expecting);
     switch (expecting) {
       case S_VALUE:
@@ -290,6 +427,61 @@ int mjson_get_number(const char *s, int len, const char *path, double *v) {
   return tok == MJSON_TOK_NUMBER ? 1 : 0;
 }
 
+// Parse the digits of an integer literal, up to the given maximum.
+static int mjson_parse_uint(const char *p, int len, unsigned long long max,
+                            unsigned long long *v) {
+  unsigned long long n = 0;
+  int i;
+  if (len <= 0) return 0;
+  for (i = 0; i < len; i++) {
+    unsigned d = (unsigned) ((unsigned char) p[i] - '0');
+    if (d > 9 || n > (max - d) / 10) return 0;
+    n = n * 10 + d;
+  }
+  *v = n;
+  return 1;
+}
+
+static int mjson_to_i64(const char *p, int len, long long *v) {
+  unsigned long long n;
+  int neg = len > 0 && p[0] == '-';
+  if (!mjson_parse_uint(p + neg, len - neg,
+                        neg ? (unsigned long long) LLONG_MAX + 1 : LLONG_MAX,
+                        &n)) {
+    return 0;
+  }
+  // Negated this way, LLONG_MIN doesn't overflow on the way.
+  *v = neg ? (n == 0 ? 0 : -(long long) (n - 1) - 1) : (long long) n;
+  return 1;
+}
+
+static int mjson_to_u32(const char *p, int len, unsigned *v) {
+  unsigned long long n;
+  if (!mjson_parse_uint(p, len, UINT_MAX, &n)) return 0;
+  *v = (unsigned) n;
+  return 1;
+}
+
+int mjson_get_i64(const char *s, int len, const char *path, long long *v) {
+  const char *p;
+  int n;
+  long long x;
+  if (mjson_find(s, len, path, &p, &n) != MJSON_TOK_NUMBER) return 0;
+  if (!mjson_to_i64(p, n, &x)) return 0;
+  if (v != NULL) *v = x;
+  return 1;
+}
+
+int mjson_get_u32(const char *s, int len, const char *path, unsigned *v) {
+  const char *p;
+  int n;
+  unsigned x;
+  if (mjson_find(s, len, path, &p, &n) != MJSON_TOK_NUMBER) return 0;
+  if (!mjson_to_u32(p, n, &x)) return 0;
+  if (v != NULL) *v = x;
+  return 1;
+}
+
 int mjson_get_bool(const char *s, int len, const char *path, int *v) {
   int tok = mjson_find(s, len, path, NULL, NULL);
   if (tok == MJSON_TOK_TRUE && v != NULL) *v = 1;
@@ -351,6 +543,69 @@ int mjson_get_hex(const char *s, int len, const char *x, char *to, int n) {
   return j;
 }
 
+// Lookup state of every field of mjson_get_many(). Each path is followed by
+// the same state machine as mjson_find(), all of them fed from a single
+// tokenizer pass that stops as soon as every path has been resolved.
+struct mjson_many_data {
+  struct msjon_get_data *get;
+  unsigned char *done;
+  int n, pending;
+};
+
+static int mjson_many_cb(int tok, const char *s, int off, int len, void *ud) {
+  struct mjson_many_data *d = (struct mjson_many_data *) ud;
+  int i;
+  for (i = 0; i < d->n; i++) {
+    if (d->done[i]) continue;
+    if (mjson_get_cb(tok, s, off, len, &d->get[i])) {
+      d->done[i] = 1;
+      d->pending--;
+    }
+  }
+  return d->pending == 0;
+}
+
+int mjson_get_many(const char *s, int len, struct mjson_field *f, int n) {
+  struct msjon_get_data *get =
+      (struct msjon_get_data *) alloca((size_t) n * sizeof(*get));
+  unsigned char *done = (unsigned char *) alloca((size_t) n);
+  struct mjson_many_data d = {get, done, n, 0};
+  int i, found = 0;
+  for (i = 0; i < n; i++) {
+    struct msjon_get_data g = {f[i].path, 1,  0,         0,         0,
+                               0,         -1, &f[i].ptr, &f[i].len, 0};
+    get[i] = g;
+    f[i].tok = MJSON_TOK_INVALID, f[i].ptr = NULL, f[i].len = 0;
+    done[i] = f[i].path[0] != '$';
+    if (!done[i]) d.pending++;
+  }
+  if (d.pending > 0 && mjson(s, len, mjson_many_cb, &d) < 0) return 0;
+  for (i = 0; i < n; i++) {
+    f[i].tok = get[i].tok;
+    if (f[i].tok == MJSON_TOK_INVALID) continue;
+    if (f[i].type == MJSON_TOK_NUMBER && f[i].tok == MJSON_TOK_NUMBER) {
+      if (f[i].to != NULL) *(double *) f[i].to = mystrtod(f[i].ptr, NULL);
+    } else if (f[i].type == MJSON_FIELD_I64 && f[i].tok == MJSON_TOK_NUMBER) {
+      long long x;
+      if (!mjson_to_i64(f[i].ptr, f[i].len, &x)) continue;
+      if (f[i].to != NULL) *(long long *) f[i].to = x;
+    } else if (f[i].type == MJSON_FIELD_U32 && f[i].tok == MJSON_TOK_NUMBER) {
+      unsigned x;
+      if (!mjson_to_u32(f[i].ptr, f[i].len, &x)) continue;
+      if (f[i].to != NULL) *(unsigned *) f[i].to = x;
+    } else if (f[i].type == MJSON_TOK_STRING && f[i].tok == MJSON_TOK_STRING) {
+      if (f[i].to != NULL && mjson_unescape(f[i].ptr + 1, f[i].len - 2,
+                                            (char *) f[i].to, f[i].n) < 0) {
+        continue;
+      }
+    } else if (f[i].type != 0) {
+      continue;
+    }
+    found++;
+  }
+  return found;
+}
+
 #if MJSON_ENABLE_BASE64
 static unsigned char mjson_base64rev(int c) {
   if (c >= 'A' && c <= 'Z') {
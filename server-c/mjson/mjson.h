@@ -50,6 +50,20 @@
 #define MJSON_ENABLE_NEXT 1
 #endif
 
+// Scan string bodies 16 bytes at a time with SSE2, or 32 with AVX2, when the
+// CPU supports them. Enabled by default on x86 targets. GCC and Clang pick the
+// scanner at runtime, so 32-bit builds without -msse2 get it too.
+#ifndef MJSON_ENABLE_SIMD
+#if defined(__SSE2__) || defined(_M_X64) ||                  \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2) ||              \
+    ((defined(__GNUC__) || defined(__clang__)) &&            \
+     (defined(__i386__) || defined(__x86_64__)))
+#define MJSON_ENABLE_SIMD 1
+#else
+#define MJSON_ENABLE_SIMD 0
+#endif
+#endif
+
 #ifndef MJSON_RPC_LIST_NAME
 #define MJSON_RPC_LIST_NAME "rpc.list"
 #endif
@@ -90,11 +104,34 @@ int mjson(const char *buf, int len, mjson_cb_t cb, void *ud);
 int mjson_find(const char *buf, int len, const char *jp, const char **tp,
                int *tl);
 int mjson_get_number(const char *buf, int len, const char *path, double *v);
+// Integers are parsed exactly, without going through a double. They fail on
+// fractions, exponents, and values out of range, leaving v untouched.
+int mjson_get_i64(const char *buf, int len, const char *path, long long *v);
+int mjson_get_u32(const char *buf, int len, const char *path, unsigned *v);
 int mjson_get_bool(const char *buf, int len, const char *path, int *v);
 int mjson_get_string(const char *buf, int len, const char *path, char *to,
                      int n);
 int mjson_get_hex(const char *buf, int len, const char *path, char *to, int n);
 
+// Field looked up by mjson_get_many(). Numbers are stored into a double, or
+// into an integer with the MJSON_FIELD_* types, and strings are unescaped into
+// a buffer of n bytes. With any other type only the raw token is kept. tok,
+// ptr and len are filled with the token found.
+#define MJSON_FIELD_I64 (MJSON_TOK_NUMBER | 0x100)  // long long, mjson_get_i64
+#define MJSON_FIELD_U32 (MJSON_TOK_NUMBER | 0x200)  // unsigned, mjson_get_u32
+struct mjson_field {
+  const char *path;  // Lookup json path, e.g. "$.score"
+  int type;          // MJSON_TOK_NUMBER, MJSON_TOK_STRING, MJSON_FIELD_*, or 0
+  void *to;          // Destination, of the type's kind or char buffer. Can be NULL
+  int n;             // Destination buffer size, for strings
+  int tok;           // Returned token, MJSON_TOK_INVALID if not found
+  const char *ptr;   // Returned token start, quotes included for strings
+  int len;           // Returned token length
+};
+
+int mjson_get_many(const char *buf, int len, struct mjson_field *fields,
+                   int nfields);
+
 #if MJSON_ENABLE_NEXT
 int mjson_next(const char *buf, int len, int offset, int *key_offset,
                int *key_len, int *val_offset, int *val_len, int *vale_type);
@@ -1,15 +1,21 @@
 // Jewelry Master Server Emulator by Renzo Pigliacampo (Hipnosis), 2022.
 #include <time.h>
-#include <math.h>
 #include <stdio.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 #include <winsock2.h>
 #include <windows.h>
+#include <psapi.h>
+#include <malloc.h>
 #include "ini/ini.h"
 #include "lmdb/lmdb.h"
-#include "mjson/mjson.h"
 #include "mongoose/mongoose.h"
+#include "jm.h"
 
 // 0. Local Mode: Runs the server on 127.0.0.1 and starts the game client. Doesn't work for LAN connections.
 // 1. Online Mode: Disables the local server emulation and connects to the 'HostName' address.
@@ -20,501 +26,751 @@ static int SERVERMODE = 0;
 static char HOSTNAME[16] = "127.0.0.1";
 // Enable network traffic hooking. If disabled, the hosts file should be edited manually.
 static int HOOKDLL = 1;
-// Allow unregistered users to be registered at the login screen.
-static int REGISTER = 1;
-// Allow users to have mutiple scores (and replays) in the global rankings.
-// Don't change once the database has already been created, will break scores.
-// Won't work if a score doesn't make it to the player's top 10 ranking.
-static int MULTISCORES = 1;
 // Disable scores and replays saving.
 static int NOSCORES = 0;
+// Serve replay files from a read-only file mapping instead of copying them through the send buffer.
+// It only applies to the legacy layout of one raw file per replay, with replays packing, compression,
+// the replay cache and the worker threads all disabled. Other replays are always sent from memory.
+static int ZEROCOPY = 0;
 // Set game process state.
 static int RUN = 1;
 
+// Request journal path, relative to the server directory. Every request is appended to it, so the traffic
+// can be replayed later with the load generator. Disabled if empty.
+static char JOURNAL[MAX_PATH] = "";
+// Expose the server statistics on '/metrics', in the Prometheus text format. Only answered to local clients.
+// 2 also walks the heap and the replays directory on each scrape, which stalls the server while they're large,
+// so it's only meant for soak runs.
+static int METRICS = 0;
+// Requests per second allowed for each client address on the reading and writing (score submission) routes.
+// Clients can burst up to twice these amounts, 0 disables the limit. Players behind the same NAT share them.
+static int READRATE = 0;
+static int WRITERATE = 0;
+// Reject requests right away while this many replays are waiting for the worker threads, 0 disables it.
+static int MAXQUEUE = 0;
+// Reject requests right away while the server loop spends this many milliseconds per iteration handling requests,
+// on average over the last few iterations, 0 disables it.
+static int MAXLAG = 0;
+// Trace one of every given number of requests, 0 disables tracing.
+// Traces are written on '/trace' requests from local clients and on exit, in the Chrome trace event format.
+static int TRACE = 0;
+// Trace file path, relative to the server directory.
+static char TRACEFILE[MAX_PATH] = "trace.json";
+
 // Declare game process variables.
 static DWORD code;
 static STARTUPINFO si;
 static PROCESS_INFORMATION pi;
 
-// Database global variables.
-static MDB_env *env;
-static MDB_txn *txn;
-static MDB_dbi dbi_user;
-static MDB_dbi dbi_ranking;
-
-void db_init()
-{
-  // Initialize environment.
-  mdb_env_create(&env);
-  mdb_env_set_maxdbs(env, 5);
-  mdb_env_open(env, "./server/db", 0, 0664);
-
-  // Initialize databases.
-  mdb_txn_begin(env, NULL, 0, &txn);
-  mdb_dbi_open(txn, "user", MDB_CREATE, &dbi_user);
-  mdb_dbi_open(txn, "ranking", MULTISCORES ? (MDB_CREATE | MDB_DUPSORT) : MDB_CREATE, &dbi_ranking);
-  mdb_txn_commit(txn);
-}
-
-void db_close()
-{
-  // Close database connections and environment.
-  mdb_dbi_close(env, dbi_user);
-  mdb_dbi_close(env, dbi_ranking);
-  mdb_env_close(env);
-}
-
-// Get the elements from the database matching the given key, or all of them if none is specified.
-// Returns a pointer to the array of char arrays. Remember to free the result value and its contents.
-void db_get(MDB_dbi dbi, char *_key, char ***res, int *len)
-{
-  // Initialize entry values.
-  MDB_cursor *cur;
-  MDB_val key, val;
-  val.mv_size = 0;
-  val.mv_data = NULL;
-  if (strlen(_key) > 0) {
-    key.mv_size = strlen(_key);
-    key.mv_data = _key;
-  } else {
-    key.mv_size = 0;
-    key.mv_data = NULL;
-  }
+// Start a 200 response with the given extra headers, leaving room to patch in the body length.
+void sb_http(struct sbuf *b, const char *headers)
+{
+  sb_printf(b, "HTTP/1.1 200 OK\r\n%sContent-Length: ", headers ? headers : "");
+  b->clen = b->len; sb_str(b, "          \r\n\r\n");
+}
+
+// Get the length of the response body.
+size_t sb_body_len(struct sbuf *b)
+{
+  return b->len - (b->clen + 14);
+}
+
+// Send a response started with sb_http(). The buffer becomes the connection send buffer if there's
+// nothing else queued, otherwise it's copied. Either way the builder is left empty.
+void sb_send(struct mg_connection *c, struct sbuf *b)
+{
+  // Content length is right-aligned in its field, leading spaces are allowed in header values.
+  char num[11]; snprintf(num, sizeof(num), "%10llu", (unsigned long long)sb_body_len(b));
+  memcpy(b->buf + b->clen, num, 10);
+  if (c->send.len == 0 && b->a == NULL) {
+    free(c->send.buf);
+    c->send.buf = (unsigned char *)b->buf; c->send.len = b->len; c->send.size = b->size;
+  } else { mg_send(c, b->buf, b->len); if (b->a == NULL) { free(b->buf); } }
+  b->buf = NULL; b->len = b->size = b->clen = 0;
+}
+
+// Routes tracked by the metrics, in the order they're matched.
+enum { MT_GAMEENTRY, MT_GETMESSAGE, MT_GETNAME, MT_GETRANKING, MT_GETREPLAY, MT_SCOREENTRY, MT_METRICS, MT_TRACE, MT_OTHER, MT_ROUTES };
+static const char *mt_routes[MT_ROUTES] = { "GameEntry", "GetMessage", "GetName", "GetRanking", "GetReplay", "ScoreEntry", "Metrics", "Trace", "Other" };
+// Reply status codes tracked by the metrics, any other one is counted as the last.
+#define MT_CODES 8
+static const int mt_codes[MT_CODES] = { 200, 206, 304, 404, 405, 429, 503, 500 };
+
+// Server metrics. Counters are atomic so they can be updated from any thread without locking.
+static struct mt_hist mt_latency[MT_ROUTES];
+static atomic_ullong mt_status_count[MT_ROUTES][MT_CODES];
+static atomic_ullong mt_accepted;
+// Status of the reply sent directly for the current request, since it doesn't go through the send buffer.
+static int mt_direct = 0;
+
+// Get the status code of an HTTP response header, or 0 if there's none.
+int mt_parse_status(const char *buf, size_t len)
+{
+  if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0) { return 0; }
+  return atoi(buf + 9);
+}
+
+// Get the status of the reply queued for a request, starting at the given offset of the send buffer.
+// Returns 0 if the reply was deferred to the worker threads.
+int mt_reply_status(struct mg_connection *c, size_t ofs)
+{
+  int status = mt_direct; mt_direct = 0;
+  if (status == 0 && c->send.len > ofs) { status = mt_parse_status((char *)c->send.buf + ofs, c->send.len - ofs); }
+  return status;
+}
 
-  // Get items from the selected database matching the query key.
-  // Stores the results values and length back to the param adresses.
+// Count a finished request for the given route.
+void mt_request(int route, int status, double ms)
+{
   int i = 0;
-  mdb_txn_begin(env, NULL, 0, &txn);
-  mdb_cursor_open(txn, dbi, &cur);
-  while ((mdb_cursor_get(cur, &key, &val, MDB_NEXT)) == 0) {
-    // Allocate space for the new value.
-    *res = realloc(*res, (i + 2) * sizeof(char *));
-    (*res)[i] = calloc(((int)val.mv_size + 4), sizeof(char));
-    strcpy((*res)[i], (char *)val.mv_data);
-    // Secure that value is a valid string.
-    (*res)[i][(int)val.mv_size] = '\0';
-    i++;
-  } *len = i;
-  mdb_cursor_close(cur);
-  mdb_txn_abort(txn);
+  while (i < MT_CODES - 1 && mt_codes[i] != status) { i++; }
+  atomic_fetch_add_explicit(&mt_status_count[route][i], 1, memory_order_relaxed);
+  mt_observe(&mt_latency[route], ms);
+}
+
+// Write a histogram in the Prometheus text format, with the durations in seconds.
+void mt_print_hist(struct sbuf *out, const char *name, const char *label, struct mt_hist *h)
+{
+  unsigned long long acc = 0;
+  for (int b = 0; b < MT_BUCKETS; b++) {
+    acc += atomic_load_explicit(&h->bucket[b], memory_order_relaxed);
+    sb_printf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, label, (16ULL << b) / 1e6, acc);
+  } acc += atomic_load_explicit(&h->bucket[MT_BUCKETS], memory_order_relaxed);
+  sb_printf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, label, acc);
+  sb_printf(out, "%s_sum{%s} %.6f\n", name, label, atomic_load_explicit(&h->sum_us, memory_order_relaxed) / 1e6);
+  sb_printf(out, "%s_count{%s} %llu\n", name, label, atomic_load_explicit(&h->count, memory_order_relaxed));
+}
+
+// Add up the size of the files in a directory and its subdirectories.
+void mt_dir_size(const char *dir, unsigned long long *bytes, unsigned long long *files)
+{
+  char pattern[MAX_PATH]; WIN32_FIND_DATAA fd;
+  snprintf(pattern, MAX_PATH, "%s\\*", dir);
+  HANDLE h = FindFirstFileA(pattern, &fd);
+  if (h == INVALID_HANDLE_VALUE) { return; }
+  do {
+    if (strcmp(fd.cFileName, ".") == 0 || strcmp(fd.cFileName, "..") == 0) { continue; }
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      char sub[MAX_PATH]; snprintf(sub, MAX_PATH, "%s\\%s", dir, fd.cFileName);
+      mt_dir_size(sub, bytes, files);
+    } else { *bytes += ((unsigned long long)fd.nFileSizeHigh << 32) | fd.nFileSizeLow; (*files)++; }
+  } while (FindNextFileA(h, &fd));
+  FindClose(h);
+}
+
+// Write the process memory, heap, database and replays storage usage, to track their growth on long runs.
+// The heap and the replays directory are only walked with 'Metrics=2', since it takes a while once they're large.
+void mt_print_resources(struct sbuf *out)
+{
+  PROCESS_MEMORY_COUNTERS pmc = { .cb = sizeof(pmc) };
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    sb_printf(out, "# TYPE jm_process_resident_bytes gauge\njm_process_resident_bytes %llu\n", (unsigned long long)pmc.WorkingSetSize);
+    sb_printf(out, "# TYPE jm_process_private_bytes gauge\njm_process_private_bytes %llu\n", (unsigned long long)pmc.PagefileUsage);
+  }
+  // Database pages in use, out of the whole map.
+  MDB_envinfo info; MDB_stat st;
+  if (mdb_env_info(env, &info) == 0 && mdb_env_stat(env, &st) == 0) {
+    sb_printf(out, "# TYPE jm_db_map_used_bytes gauge\njm_db_map_used_bytes %llu\n", (unsigned long long)(info.me_last_pgno + 1) * st.ms_psize);
+    sb_printf(out, "# TYPE jm_db_map_size_bytes gauge\njm_db_map_size_bytes %llu\n", (unsigned long long)info.me_mapsize);
+  }
+  if (METRICS < 2) { return; }
+  // Blocks in use and free in the C runtime heap, the one malloc() takes memory from.
+  unsigned long long used = 0, free_b = 0, blocks = 0;
+  _HEAPINFO hi = { 0 };
+  while (_heapwalk(&hi) == _HEAPOK) {
+    if (hi._useflag == _USEDENTRY) { used += hi._size; blocks++; } else { free_b += hi._size; }
+  }
+  sb_printf(out, "# TYPE jm_heap_used_bytes gauge\njm_heap_used_bytes %llu\n", used);
+  sb_printf(out, "# TYPE jm_heap_free_bytes gauge\njm_heap_free_bytes %llu\n", free_b);
+  sb_printf(out, "# TYPE jm_heap_blocks gauge\njm_heap_blocks %llu\n", blocks);
+  unsigned long long rep_bytes = 0, rep_files = 0;
+  mt_dir_size(REPDIR, &rep_bytes, &rep_files);
+  sb_printf(out, "# TYPE jm_replay_dir_bytes gauge\njm_replay_dir_bytes %llu\n", rep_bytes);
+  sb_printf(out, "# TYPE jm_replay_dir_files gauge\njm_replay_dir_files %llu\n", rep_files);
+}
+
+// Traced requests. Requests seen so far, used for sampling, and the trace file path, resolved once on start.
+static unsigned long tr_count = 0;
+static char tr_path[MAX_PATH];
+
+// Send a response header and body with a single gathered socket write.
+// Whatever the socket doesn't accept right away gets queued into the send buffer.
+void send_direct(struct mg_connection *c, const char *hdr, size_t hdr_len, const char *body, size_t body_len)
+{
+  // Write to the socket only if there's nothing already queued before this response.
+  size_t sent = 0; mt_direct = mt_parse_status(hdr, hdr_len); double t = tr_begin();
+  if (c->send.len == 0) {
+    DWORD n = 0; WSABUF bufs[2] = { { (ULONG)hdr_len, (char *)hdr }, { (ULONG)body_len, (char *)body } };
+    if (WSASend((SOCKET)(size_t)c->fd, bufs, 2, &n, 0, NULL, NULL) == 0) { sent = n; }
+  }
+  // Queue the remaining bytes, mongoose will flush them on the next write events.
+  if (sent < hdr_len) {
+    mg_send(c, hdr + sent, hdr_len - sent); sent = hdr_len;
+  } if (sent - hdr_len < body_len) {
+    mg_send(c, body + (sent - hdr_len), body_len - (sent - hdr_len));
+  } tr_end("send", t);
+}
+
+// Pre-serialized headers for the few response shapes the game gets, up to the Content-Length value.
+// They match what mg_http_reply() would format, so clients can't tell the difference.
+enum { HT_OK, HT_BAD_REQUEST, HT_NOT_FOUND, HT_TOO_MANY, HT_UNAVAILABLE, HT_TEMPLATES };
+static const struct mg_str ht_templates[HT_TEMPLATES] = {
+  MG_C_STR("HTTP/1.1 200 OK\r\nContent-Length: "),
+  MG_C_STR("HTTP/1.1 400 Bad Request\r\nContent-Length: "),
+  MG_C_STR("HTTP/1.1 404 Not Found\r\nContent-Length: "),
+  MG_C_STR("HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: "),
+  MG_C_STR("HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: "),
+};
+
+// Reply using one of the header templates, with only the body length formatted per request.
+// Header and body are written from their own buffers, so the body is never copied if the socket takes it all.
+void http_send(struct mg_connection *c, int tpl, const char *body, size_t len)
+{
+  char hdr[128], num[24]; int i = sizeof(num);
+  unsigned long long u = len;
+  do { num[--i] = '0' + (u % 10); u /= 10; } while (u > 0);
+  size_t n = ht_templates[tpl].len;
+  memcpy(hdr, ht_templates[tpl].ptr, n);
+  memcpy(hdr + n, num + i, sizeof(num) - i); n += sizeof(num) - i;
+  memcpy(hdr + n, "\r\n\r\n", 4); n += 4;
+  send_direct(c, hdr, n, body, len);
 }
 
-// Get a single (first) element from the database matching the given key.
-// Returns a pointer to the char array. Remember to free the return value.
-char *db_get_one(MDB_dbi dbi, char *_key)
+// Reply with a null-terminated body.
+void http_reply(struct mg_connection *c, int tpl, const char *body)
 {
-  // Initialize entry values.
-  MDB_val key, val;
-  key.mv_size = strlen(_key);
-  key.mv_data = _key;
-  val.mv_size = 0;
-  val.mv_data = NULL;
+  http_send(c, tpl, body, strlen(body));
+}
 
-  // Get an item from the selected database.
-  mdb_txn_begin(env, NULL, 0, &txn);
-  mdb_get(txn, dbi, &key, &val);
-  mdb_txn_abort(txn);
+// Query parameter kinds. Texts can't hold characters that would break the stored JSON objects,
+// keys are alphanumeric since they're used for file names, and integers are parsed right away.
+enum { QF_TEXT, QF_KEY, QF_INT };
+struct q_field { const char *name; int type, required; size_t ofs, size; };
+#define Q_FIELD(s, m, type, required) { #m, type, required, offsetof(struct s, m), sizeof(((struct s *)0)->m) }
+
+// Parameters of each route, decoded into the typed query structs from jm.h. Fields are listed in the same order as in their struct.
+static const struct q_field q_login_fields[] = {
+  Q_FIELD(q_login, id, QF_TEXT, 0), Q_FIELD(q_login, pass, QF_TEXT, 0)
+};
+static const struct q_field q_ranking_fields[] = {
+  Q_FIELD(q_ranking, id, QF_TEXT, 0), Q_FIELD(q_ranking, mode, QF_INT, 0), Q_FIELD(q_ranking, view, QF_INT, 0)
+};
+static const struct q_field q_replay_fields[] = {
+  Q_FIELD(q_replay, id, QF_KEY, 1)
+};
+static const struct q_field q_score_fields[] = {
+  Q_FIELD(q_score, id, QF_TEXT, 1), Q_FIELD(q_score, mode, QF_INT, 1), Q_FIELD(q_score, score, QF_INT, 1),
+  Q_FIELD(q_score, jewel, QF_INT, 1), Q_FIELD(q_score, level, QF_INT, 1), Q_FIELD(q_score, class, QF_INT, 1),
+  Q_FIELD(q_score, time, QF_INT, 1)
+};
+
+// Check a decoded parameter value and store it. Returns 0 if it's not valid for its kind.
+int q_store(const struct q_field *f, const char *val, int len, char *dst)
+{
+  if (f->type == QF_INT) {
+    // Parse the integer, checking for overflows.
+    int i = val[0] == '-' ? 1 : 0; long long n = 0;
+    if (i == len) { return 0; }
+    for (; i < len; i++) {
+      if (val[i] < '0' || val[i] > '9' || n > (LLONG_MAX - (val[i] - '0')) / 10) { return 0; }
+      n = n * 10 + (val[i] - '0');
+    } *(long long *)dst = val[0] == '-' ? -n : n;
+    return 1;
+  }
+  if ((size_t)len >= f->size) { return 0; }
+  for (int i = 0; i < len; i++) {
+    unsigned char ch = (unsigned char)val[i];
+    if (ch < 32 || ch == '"' || ch == '\\' || ch == 127) { return 0; }
+    if (f->type == QF_KEY && !((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'))) { return 0; }
+  } memcpy(dst, val, len); dst[len] = '\0';
+  return 1;
+}
 
-  // Make sure the value is a valid string.
-  char *buf = malloc((int)val.mv_size + 2);
-  memcpy(buf, val.mv_data, (int)val.mv_size);
-  buf[(int)val.mv_size] = '\0';
-  return buf;
+// Decode a query string into a typed struct in a single pass. Unknown parameters are skipped and,
+// like mg_http_get_var(), only the first of repeated ones is used.
+// Returns 0 if the query is malformed, with the reason written to 'err'.
+int q_decode(struct mg_str q, const struct q_field *f, int n, void *dst, char *err, size_t err_size)
+{
+  unsigned int seen = 0;
+  memset(dst, 0, f[n - 1].ofs + f[n - 1].size);
+  const char *p = q.ptr, *end = q.ptr + q.len;
+  while (p < end) {
+    // Split the next 'name=value' pair.
+    const char *amp = memchr(p, '&', end - p); if (amp == NULL) { amp = end; }
+    const char *eq = memchr(p, '=', amp - p); if (eq == NULL) { eq = amp; }
+    const char *v = eq < amp ? eq + 1 : amp;
+    int i = 0;
+    while (i < n && (strlen(f[i].name) != (size_t)(eq - p) || memcmp(f[i].name, p, eq - p) != 0)) { i++; }
+    p = amp + 1;
+    if (i == n || (seen & (1u << i))) { continue; }
+
+    // Decode the value and store it.
+    char val[40]; int len = mg_url_decode(v, amp - v, val, sizeof(val), 1);
+    if (len < 0 || !q_store(&f[i], val, len, (char *)dst + f[i].ofs)) {
+      snprintf(err, err_size, "Invalid '%s' parameter.", f[i].name); return 0;
+    } seen |= 1u << i;
+  }
+  for (int i = 0; i < n; i++) {
+    if (f[i].required && !(seen & (1u << i))) { snprintf(err, err_size, "Missing '%s' parameter.", f[i].name); return 0; }
+  } return 1;
 }
 
-// Store a new key/value entry into the database, or update an already existing one.
-void db_put(MDB_dbi dbi, char *_key, char *_val)
+// Decode the request query for a route, replying with an error if it's malformed.
+// Returns 0 if the request can't go on.
+int q_parse(struct mg_connection *c, struct mg_http_message *hm, const struct q_field *f, int n, void *dst)
 {
-  // Initialize entry values.
-  MDB_val key, val;
-  key.mv_size = strlen(_key);
-  key.mv_data = _key;
-  val.mv_size = strlen(_val);
-  val.mv_data = _val;
+  char err[60];
+  if (q_decode(hm->query, f, n, dst, err, sizeof(err))) { return 1; }
+  log_push(LOG_INFO, "Malformed", hm->query.ptr, hm->query.len);
+  char body[64]; int body_len = snprintf(body, sizeof(body), "%s\n", err);
+  http_send(c, HT_BAD_REQUEST, body, (size_t)body_len);
+  return 0;
+}
 
-  // Store/update entry in database.
-  mdb_txn_begin(env, NULL, 0, &txn);
-  mdb_put(txn, dbi, &key, &val, 0);
-  mdb_txn_commit(txn);
+// Serve a replay file straight from a file mapping.
+// Returns 0 if the file can't be served this way, so the caller can fall back to mg_http_serve_file().
+int serve_mapped(struct mg_connection *c, struct mg_http_message *hm, const char *path)
+{
+  // Leave partial and conditional requests to mongoose.
+  if (mg_http_get_header(hm, "Range") != NULL || mg_http_get_header(hm, "If-None-Match") != NULL) { return 0; }
+  HANDLE fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (fh == INVALID_HANDLE_VALUE) { return 0; }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(fh, &size) || size.QuadPart == 0) { CloseHandle(fh); return 0; }
+
+  // Map the whole file, the view stays valid after closing the handles until it's unmapped.
+  HANDLE fm = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+  char *view = fm != NULL ? MapViewOfFile(fm, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (fm != NULL) { CloseHandle(fm); } CloseHandle(fh);
+  if (view == NULL) { return 0; }
+
+  // Build the same headers mongoose sends for static files.
+  struct stat st; char etag[64], hdr[200];
+  stat(path, &st);
+  snprintf(etag, sizeof(etag), "\"%lld.%lld\"", (long long)st.st_mtime, (long long)size.QuadPart);
+  int hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\nEtag: %s\r\nContent-Length: %lld\r\n\r\n", etag, (long long)size.QuadPart);
+  send_direct(c, hdr, hdr_len, view, (size_t)size.QuadPart);
+  atomic_fetch_add_explicit(&mt_rep_read, (unsigned long long)size.QuadPart, memory_order_relaxed);
+  UnmapViewOfFile(view);
+  return 1;
 }
 
-// Sort given elements in ascending order.
-int cmp_asc(const void *a, const void *b)
+// Send a game handler reply on a connection. Nothing is sent for replies deferred to the worker threads.
+void reply_send(struct mg_connection *c, struct mg_http_message *hm, struct reply *r)
 {
-  const char *_a = *(const char **)a;
-  const char *_b = *(const char **)b;
+  if (r->status == 0) { return; }
+  if (r->file[0] != '\0') {
+    // Replays left on disk are mapped, or served by mongoose for partial and conditional requests.
+    if (ZEROCOPY && serve_mapped(c, hm, r->file)) { return; }
+    struct mg_http_serve_opts opts = { };
+    mg_http_serve_file(c, hm, r->file, &opts);
+  } else if (r->hdr != NULL) {
+    send_direct(c, r->hdr, r->hdr_len, r->body, r->len);
+  } else if (r->body != NULL) {
+    http_send(c, r->status == 404 ? HT_NOT_FOUND : HT_OK, r->body, r->len);
+  } else { http_send(c, r->status == 404 ? HT_NOT_FOUND : HT_OK, r->out.buf ? r->out.buf : "", r->out.len); }
+  reply_free(r);
+}
 
-  double buf_a_d, buf_b_d;
-  mjson_get_number(_a, strlen(_a), "$.score", &buf_a_d);
-  mjson_get_number(_b, strlen(_b), "$.score", &buf_b_d);
+// Worker threads glue. Finished jobs wake up the server loop through a socket pair, and their replies
+// go to the connections they were deferred for, found by id.
+static struct mg_mgr *io_mgr = NULL;
+static int io_pipe = -1;
 
-  int buf_a_i = (int)buf_a_d, buf_b_i = (int)buf_b_d;
-  return (buf_b_i - buf_a_i);
+// Wake up the server loop, called from the worker threads.
+void io_notify()
+{
+  send((SOCKET)io_pipe, "", 1, 0);
 }
 
-// Sort given elements in descending order.
-int cmp_des(const void *a, const void *b)
+// Finish the jobs done by the worker threads once the server loop is woken up.
+static void io_ready(struct mg_connection *pc, int ev, void *ev_data, void *fn_data)
 {
-  const char *_a = *(const char **)a;
-  const char *_b = *(const char **)b;
+  if (ev != MG_EV_READ) { return; }
+  pc->recv.len = 0; io_complete();
+}
+
+// Create the socket pair and start the worker threads. They're disabled if the socket pair can't be created.
+void io_start(struct mg_mgr *mgr)
+{
+  io_mgr = mgr;
+  if (ASYNCIO && (io_pipe = mg_mkpipe(mgr, io_ready, NULL, false)) == -1) { ASYNCIO = 0; }
+  io_init(io_notify);
+}
 
-  double buf_a_d, buf_b_d;
-  mjson_get_number(_a, strlen(_a), "$.score", &buf_a_d);
-  mjson_get_number(_b, strlen(_b), "$.score", &buf_b_d);
+// Send a reply deferred to the worker threads if its connection is still open, and count it for the route.
+void reply_deferred(struct reply *r, int route)
+{
+  struct mg_connection *c = io_mgr->conns;
+  while (c != NULL && c->id != (unsigned long)(size_t)r->ctx) { c = c->next; }
+  if (c == NULL) { return; }
+  size_t ofs = c->send.len;
+  reply_send(c, NULL, r);
+  mt_request(route, mt_reply_status(c, ofs), now_ms() - r->t);
+}
 
-  int buf_a_i = (int)buf_a_d, buf_b_i = (int)buf_b_d;
-  return (buf_a_i - buf_b_i);
+// Completion callbacks of the replay reads and the score entries.
+void replay_done(struct reply *r)
+{
+  reply_deferred(r, MT_GETREPLAY);
 }
 
-// Get fixed length random number.
-char *random_num(char *buf)
+void score_done(struct reply *r)
 {
-  for (int i = 0; i < 16; i++) {
-    buf[i] = (rand() % 10) + '0';
-  } buf[16] = '\0'; return buf;
+  reply_deferred(r, MT_SCOREENTRY);
 }
 
-// Authenticate user. Used for login, getting rankings and starting games.
-// Response: '1': Auth error | '10': Connection error | ?: Version error.
-// Params: 'game', 'id', 'pass', 'ver'.
+// Mongoose adapters for the game handlers. They decode the request, run the handler and send its reply.
+// Handlers that can defer their reply get the connection id to send it to.
 void game_entry(struct mg_connection *c, struct mg_http_message *hm)
 {
-  // Get query param values.
-  char q_id[18], q_pass[18];
-  mg_http_get_var(&hm->query, "id", q_id, sizeof(q_id));
-  mg_http_get_var(&hm->query, "pass", q_pass, sizeof(q_pass));
-
-  // Get selected user from database.
-  char *user = db_get_one(dbi_user, q_id);
-  // Check if user exists and the credentials are correct.
-  if (strlen(user) > 0) {
-    // Get password value from user object.
-    char u_pass[18];
-    mjson_get_string(user, strlen(user), "$.pass", u_pass, sizeof(u_pass));
-    mg_http_reply(c, 200, NULL, strcmp(q_pass, u_pass) == 0 ? "" : "1");
-  // Check for users with the same id and create a new one if allowed.
-  } else if (strlen(q_id) > 0 && REGISTER) {
-    // Store new user into the database.
-    char u_str[100];
-    snprintf(u_str, 100, "{\"id\":\"%s\",\"pass\":\"%s\",\"count\":0,\"rankings\":[]}", q_id, q_pass);
-    db_put(dbi_user, q_id, u_str);
-    mg_http_reply(c, 200, NULL, "");
-  // An user with this id already exists or wrong user id or password.
-  } else { mg_http_reply(c, 200, NULL, "1"); }
-  // Free memory allocated for user data.
-  free(user);
-}
-
-// Get rankings/leaderboards data.
-// Params: 'id', 'mode', 'view'.
+  struct q_login q; struct reply r;
+  if (!q_parse(c, hm, q_login_fields, 2, &q)) { return; }
+  reply_init(&r, NULL, NULL); jm_game_entry(&q, &r); reply_send(c, hm, &r);
+}
+
 void get_ranking(struct mg_connection *c, struct mg_http_message *hm)
 {
-  // Get query param values.
-  char q_id[18] = "", q_mode[2], q_view[4];
-  mg_http_get_var(&hm->query, "id", q_id, sizeof(q_id));
-  mg_http_get_var(&hm->query, "mode", q_mode, sizeof(q_mode));
-  mg_http_get_var(&hm->query, "view", q_view, sizeof(q_view));
-
-  // Convert mode query parameter to double.
-  char *q_mode_p; double q_mode_d = strtod(q_mode, &q_mode_p);
-  char *q_view_p; double q_view_d = strtod(q_view, &q_view_p);
-
-  // Manage personal rankings.
-  if (strlen(q_id) > 0 && q_view_d == 0) {
-    char *user = db_get_one(dbi_user, q_id);
-    // Get and parse user rankings object.
-    double u_count;
-    mjson_get_number(user, strlen(user), "$.count", &u_count);
-    // Store the ranking objects for the selected mode.
-    char *u_ranks = calloc(1, sizeof(char));
-    for (int i = 0; i < u_count; i++) {
-      double r_mode; char r_mode_s[24];
-      snprintf(r_mode_s, 24, "%s%d%s", "$.rankings[", i, "].mode");
-      mjson_get_number(user, strlen(user), r_mode_s, &r_mode);
-      if (r_mode == q_mode_d) {
-        // Get user ranking object values.
-        double r_score; char r_score_s[24];
-        snprintf(r_score_s, 24, "%s%d%s", "$.rankings[", i, "].score");
-        mjson_get_number(user, strlen(user), r_score_s, &r_score);
-        double r_level; char r_level_s[24];
-        snprintf(r_level_s, 24, "%s%d%s", "$.rankings[", i, "].level");
-        mjson_get_number(user, strlen(user), r_level_s, &r_level);
-        double r_time; char r_time_s[24];
-        snprintf(r_time_s, 24, "%s%d%s", "$.rankings[", i, "].time");
-        mjson_get_number(user, strlen(user), r_time_s, &r_time);
-        double r_jewel; char r_jewel_s[24];
-        snprintf(r_jewel_s, 24, "%s%d%s", "$.rankings[", i, "].jewel");
-        mjson_get_number(user, strlen(user), r_jewel_s, &r_jewel);
-
-        // Build formatted response string.
-        char r_str[200]; int lit = strlen(u_ranks) == 0 ? 1 : 0;
-        snprintf(r_str, 200, "0\n0\n%s\n%d\n0\n%d\n0\n%d\n%d\n%d", q_id, (int)r_score, (int)r_level, (int)r_time, (int)r_jewel, lit);
-        u_ranks = realloc(u_ranks, strlen(u_ranks) + strlen(r_str) + 2);
-        if (strlen(u_ranks) > 0) { strcat(u_ranks, "."); }
-        strcat(u_ranks, r_str);
-      }
-    } mg_http_reply(c, 200, NULL, "%s", u_ranks);
-    // Free memory allocated for user rankings and data.
-    free(user); free(u_ranks);
-
-  // Manage global rankings.
-  } else {
-    char **rank = calloc(1, sizeof(char *)); int r_len;
-    db_get(dbi_ranking, "", &rank, &r_len);
-
-    if (r_len > 0) {
-      // Get the ranking objects for the selected mode.
-      char **rank_mode = calloc(1, sizeof(char *)); int r_mode_len = 0;
-      for (int i = 0; i < r_len; i++) {
-        double r_mode;
-        mjson_get_number(rank[i], strlen(rank[i]), "$.mode", &r_mode);
-        if (r_mode == q_mode_d) {
-          // Allocate space for the new user ranking insert.
-          if (r_mode_len > 0) { rank_mode = realloc(rank_mode, (r_mode_len + 2) * sizeof(char *)); }
-          rank_mode[r_mode_len] = calloc(strlen(rank[i]) + 2, sizeof(char));
-          strncpy(rank_mode[r_mode_len], rank[i], strlen(rank[i]));
-          r_mode_len++;
-        }
-      }
-      // Sort results for the selected mode.
-      qsort(rank_mode, (int)r_mode_len, sizeof(char *), cmp_asc);
-      // Set rankings table index.
-      int idx = strcmp(q_view, "-1") == 0 ? 0 : (int)q_view_d;
-      if (strlen(q_id) > 0) {
-        // Get user score position table index.
-        int f = -1;
-        for (int i = 0; i < r_mode_len; i++) {
-          char r_id[20];
-          mjson_get_string(rank_mode[i], strlen(rank_mode[i]), "$.id", r_id, sizeof(r_id));
-          if (strcmp(r_id, q_id) == 0) { f = i; break; }
-        } if (f != -1) { idx = floor(f / 10); }
-      }
-
-      // Fill the 10-slots scores table.
-      char *g_ranks = calloc(1, sizeof(char));  int lit_f = 0;
-      for (int i = (idx * 10); i < (idx * 10 + 10); i++) {
-        if (i >= (r_mode_len)) { break; }
-        // Get global rankings object values.
-        char r__id[30]; char r_id[20]; double r_score, r_level, r_class, r_time, r_jewel;
-        mjson_get_string(rank_mode[i], strlen(rank_mode[i]), "$._id", r__id, sizeof(r__id));
-        mjson_get_string(rank_mode[i], strlen(rank_mode[i]), "$.id", r_id, sizeof(r_id));
-        mjson_get_number(rank_mode[i], strlen(rank_mode[i]), "$.score", &r_score);
-        mjson_get_number(rank_mode[i], strlen(rank_mode[i]), "$.level", &r_level);
-        mjson_get_number(rank_mode[i], strlen(rank_mode[i]), "$.class", &r_class);
-        mjson_get_number(rank_mode[i], strlen(rank_mode[i]), "$.time", &r_time);
-        mjson_get_number(rank_mode[i], strlen(rank_mode[i]), "$.jewel", &r_jewel);
-
-        // Build formatted response string.
-        int lit = strcmp(r_id, q_id) == 0 && !lit_f ? 1 : 0;
-        if (strcmp(r_id, q_id) == 0) { lit_f = 1;} char r_str[200];
-        snprintf(r_str, 200, "%d\n%s\n%s\n%d\n0\n%d\n%d\n%d\n%d\n%d", idx, r__id, r_id, (int)r_score, (int)r_level, (int)r_class, (int)r_time, (int)r_jewel, lit);
-        g_ranks = realloc(g_ranks, strlen(g_ranks) + strlen(r_str) + 2);
-        if (strlen(g_ranks) > 0) { strcat(g_ranks, "."); }
-        strcat(g_ranks, r_str);
-      } mg_http_reply(c, 200, NULL, "%s", g_ranks);
-
-      // Free memory allocated for mode rankings.
-      for (int i = 0; i < r_mode_len; i++) {
-        free(rank_mode[i]);
-      } free(rank_mode); free(g_ranks);
-    } else { mg_http_reply(c, 200, NULL, ""); }
-
-    // Free memory allocated for global rankings.
-    for (int i = 0; i < r_len; i++) {
-      free(rank[i]);
-    } free(rank);
-  }
+  struct q_ranking q; struct reply r;
+  if (!q_parse(c, hm, q_ranking_fields, 3, &q)) { return; }
+  reply_init(&r, NULL, NULL); jm_get_ranking(&q, &r); reply_send(c, hm, &r);
 }
 
-// Get replay for the selected score.
-// Params: 'id', 'mode', 'view'.
 void get_replay(struct mg_connection *c, struct mg_http_message *hm)
 {
-  // Get query param values.
-  char q_id[30], q_mode[2], q_view[4];
-  mg_http_get_var(&hm->query, "id", q_id, sizeof(q_id));
-
-  // Load and send replay file.
-  char r_dir[MAX_PATH], r_file[MAX_PATH];
-  GetCurrentDirectory(MAX_PATH, r_dir);
-  snprintf(r_file, MAX_PATH, "%s\\server\\rep\\%s.rep", r_dir, q_id);
-  struct mg_http_serve_opts opts = { };
-  mg_http_serve_file(c, hm, r_file, &opts);
+  struct q_replay q; struct reply r;
+  if (!q_parse(c, hm, q_replay_fields, 1, &q)) { return; }
+  // The validator is passed on as a string, an ETag longer than ours can't match anyway.
+  struct mg_str *h = mg_http_get_header(hm, "If-None-Match"); char inm[24] = "";
+  if (h != NULL && h->len < sizeof(inm)) { memcpy(inm, h->ptr, h->len); inm[h->len] = '\0'; }
+  // Raw replay files are left to mongoose for ranges, and mapped with ZeroCopy.
+  int flags = mg_http_get_header(hm, "Range") != NULL ? REP_RANGED | REP_FILE : ZEROCOPY ? REP_FILE : 0;
+  reply_init(&r, replay_done, (void *)(size_t)c->id);
+  jm_get_replay(&q, h != NULL ? inm : NULL, flags, &r);
+  reply_send(c, hm, &r);
 }
 
-// Send user score to rankings/leaderboards and replay data.
-// Params: 'id', 'mode', 'score', 'jewel', 'level', 'class', 'time'.
 void score_entry(struct mg_connection *c, struct mg_http_message *hm)
 {
-  // Get query param values.
-  char q_id[18], q_mode[2], q_score[12], q_jewel[6], q_level[4], q_class[4], q_time[18], q_key[20];
-  mg_http_get_var(&hm->query, "id", q_id, sizeof(q_id));
-  mg_http_get_var(&hm->query, "mode", q_mode, sizeof(q_mode));
-  mg_http_get_var(&hm->query, "score", q_score, sizeof(q_score));
-  mg_http_get_var(&hm->query, "jewel", q_jewel, sizeof(q_jewel));
-  mg_http_get_var(&hm->query, "level", q_level, sizeof(q_level));
-  mg_http_get_var(&hm->query, "class", q_class, sizeof(q_class));
-  mg_http_get_var(&hm->query, "time", q_time, sizeof(q_time));
-
-  // Convert mode query parameter to double.
-  char *q_mode_p; double q_mode_d = strtod(q_mode, &q_mode_p);
-  char *q_score_p; double q_score_d = strtod(q_score, &q_score_p);
-  // Generate unique identifiable key for rankings.
-  snprintf(q_key, 20, "%s%s", q_id, q_mode);
-
-  // Manage global rankings database and replays storage.
-  char *rank = db_get_one(dbi_ranking, q_key);
-  // Update user score entry if already present.
-  if (strlen(rank) > 0 && !MULTISCORES) {
-    // Replace only if the score is higher than the already stored.
-    double r_score;
-    mjson_get_number(rank, strlen(rank), "$.score", &r_score);
-    if (q_score_d > r_score) {
-      // Update ranking entry in database.
-      char r_id[25], r_str[200], r_dir[MAX_PATH], r_file[MAX_PATH];
-      mjson_get_string(rank, strlen(rank), "$._id", r_id, sizeof(r_id));
-      snprintf(r_str, 200, "{\"_id\":\"%s\",\"id\":\"%s\",\"mode\":%s,\"score\":%s,\"jewel\":%s,\"level\":%s,\"class\":%s,\"time\":%s}", r_id, q_id, q_mode, q_score, q_jewel, q_level, q_class, q_time);
-      db_put(dbi_ranking, q_key, r_str);
-
-      // Delete previous replay file and replace it with the new one.
-      GetCurrentDirectory(MAX_PATH, r_dir);
-      snprintf(r_file, MAX_PATH, "%s\\server\\rep\\%s.rep", r_dir, r_id);
-      struct mg_http_part part; size_t ofs = 0;
-      mg_http_next_multipart(hm->body, ofs, &part);
-      remove(r_file);
-      FILE *fp = fopen(r_file, "w");
-      fwrite(part.body.ptr, (unsigned long)part.body.len, sizeof(char), fp);
-      fclose(fp);
-    }
+  struct q_score q; struct reply r;
+  if (!q_parse(c, hm, q_score_fields, 7, &q)) { return; }
+  // The replay is the first part of the multipart body.
+  struct mg_http_part part = { 0 };
+  mg_http_next_multipart(hm->body, 0, &part);
+  reply_init(&r, score_done, (void *)(size_t)c->id);
+  jm_score_entry(&q, part.body.ptr, part.body.len, &r); reply_send(c, hm, &r);
+}
+
+// Client token buckets, in a fixed-size hash table probed linearly over a few slots.
+// When all of them are taken, the least recently seen client is replaced.
+#define RL_SLOTS 4096
+#define RL_PROBES 8
+struct rl_bucket { unsigned long long key; double read, write, last; };
+static struct rl_bucket rl_table[RL_SLOTS];
+// Time the server loop spends handling requests per iteration, smoothed so a single slow request doesn't
+// shed the ones after it, and the time spent during the current iteration.
+static double ad_lag = 0, ad_work = 0;
+
+// Refill a token bucket for the elapsed milliseconds.
+void rl_refill(double *tokens, int rate, double elapsed)
+{
+  *tokens += elapsed * rate / 1000.0;
+  if (*tokens > rate * 2) { *tokens = rate * 2; }
+}
 
-  // Add score entry if it's from a new user or multiple scores are enabled.
-  } else {
-    // Store new score entry in the rankings database.
-    char r_id[18]; random_num(r_id);
-    char r_str[200], r_dir[MAX_PATH], r_file[MAX_PATH];
-    snprintf(r_str, 200, "{\"_id\":\"%s\",\"id\":\"%s\",\"mode\":%s,\"score\":%s,\"jewel\":%s,\"level\":%s,\"class\":%s,\"time\":%s}", r_id, q_id, q_mode, q_score, q_jewel, q_level, q_class, q_time);
-    db_put(dbi_ranking, q_key, r_str);
-
-    // Store replay file with the newly created id as the filename.
-    GetCurrentDirectory(MAX_PATH, r_dir);
-    snprintf(r_file, MAX_PATH, "%s\\server\\rep\\%s.rep", r_dir, r_id);
-    struct mg_http_part part; size_t ofs = 0;
-    mg_http_next_multipart(hm->body, ofs, &part);
-    FILE *fp = fopen(r_file, "w");
-    fwrite(part.body.ptr, (unsigned long)part.body.len, sizeof(char), fp);
-    fclose(fp);
+// Check the rate limit of the client address for a reading or writing request.
+// Returns 0 if the request must be rejected.
+int rl_allow(struct mg_connection *c, int write)
+{
+  if ((write ? WRITERATE : READRATE) <= 0) { return 1; }
+  unsigned long long key = c->rem.is_ip6 ? fnv1a((const char *)c->rem.ip6, 16) : c->rem.ip;
+  // Find the client bucket, or the oldest slot to reuse.
+  double now = now_ms();
+  struct rl_bucket *b = NULL, *old = NULL;
+  for (int i = 0; i < RL_PROBES; i++) {
+    struct rl_bucket *e = &rl_table[(key + i) & (RL_SLOTS - 1)];
+    if (e->last > 0 && e->key == key) { b = e; break; }
+    if (old == NULL || e->last < old->last) { old = e; }
   }
-  // Free memory allocated for global rankings.
-  free(rank);
-
-  // Manage personal rankings from the users database.
-  char *user = db_get_one(dbi_user, q_id);
-  // Get and parse user rankings object.
-  double u_count;
-  mjson_get_number(user, strlen(user), "$.count", &u_count);
-  // Store the ranking objects for the selected mode and the total length.
-  int u_ranks_mode = 0;
-  char **u_ranks = calloc(1, sizeof(char *));
-  for (int i = 0; i < u_count; i++) {
-    // Calculate amount of items for the selected mode.
-    double u_rank_mode; char u_rank_mode_s[24];
-    snprintf(u_rank_mode_s, 24, "%s%d%s", "$.rankings[", i, "].mode");
-    mjson_get_number(user, strlen(user), u_rank_mode_s, &u_rank_mode);
-    if (u_rank_mode == q_mode_d) { u_ranks_mode++; }
-
-    // Add ranking object to user rankings array for future sorting and updating.
-    const char *u_rank; int u_rank_len; char u_rank_s[24];
-    snprintf(u_rank_s, 24, "%s%d%s", "$.rankings[", i, "]");
-    mjson_find(user, strlen(user), u_rank_s, &u_rank, &u_rank_len);
-    // Allocate space for the new user ranking insert.
-    if (i > 0) { u_ranks = realloc(u_ranks, (i + 2) * sizeof(char *)); }
-    u_ranks[i] = calloc(strlen(u_rank) + 2, sizeof(char));
-    strncpy(u_ranks[i], u_rank, u_rank_len);
+  if (b == NULL) {
+    b = old; b->key = key; b->last = now;
+    b->read = READRATE * 2; b->write = WRITERATE * 2;
   }
+  rl_refill(&b->read, READRATE, now - b->last);
+  rl_refill(&b->write, WRITERATE, now - b->last); b->last = now;
+  // Take a token from the bucket of the request kind.
+  double *tokens = write ? &b->write : &b->read;
+  if (*tokens < 1) { return 0; }
+  *tokens -= 1; return 1;
+}
 
-  // Check if the user rankings slots are full for the selected mode.
-  if (u_ranks_mode == 10) {
-    // Sort rankings to get the smallest score for the selected mode.
-    qsort(u_ranks, u_count, sizeof(char *), cmp_des);
-    int u_ranks_sm = 0;
-    for (int i = 0; i < u_count; i++) {
-      double u_rank_mode;
-      mjson_get_number(u_ranks[i], strlen(u_ranks[i]), "$.mode", &u_rank_mode);
-      if (u_rank_mode == q_mode_d) {
-        u_ranks_sm = i; break;
-      }
-    }
-    // Replace only if the score is higher than the smallest stored.
-    double u_rank_score;
-    mjson_get_number(u_ranks[u_ranks_sm], strlen(u_ranks[u_ranks_sm]), "$.score", &u_rank_score);
-    if (q_score_d > u_rank_score) {
-      char r_str[200];
-      snprintf(r_str, 200, "{\"id\":\"%s\",\"mode\":%s,\"score\":%s,\"jewel\":%s,\"level\":%s,\"class\":%s,\"time\":%s}", q_id, q_mode, q_score, q_jewel, q_level, q_class, q_time);
-      u_ranks[u_ranks_sm] = realloc(u_ranks[u_ranks_sm], strlen(r_str) + 2);
-      strncpy(u_ranks[u_ranks_sm], r_str, strlen(r_str));
-    }
+// Check if the server can take more work. Returns 0 if the request must be shed.
+int ad_allow()
+{
+  if (MAXLAG > 0 && ad_lag > MAXLAG) { return 0; }
+  if (MAXQUEUE > 0 && ASYNCIO && io_queued() >= MAXQUEUE) { return 0; }
+  return 1;
+}
 
-  // Add new score entry to the user personal ranking.
-  } else {
-    u_count++; char r_str[200];
-    snprintf(r_str, 200, "{\"id\":\"%s\",\"mode\":%s,\"score\":%s,\"jewel\":%s,\"level\":%s,\"class\":%s,\"time\":%s}", q_id, q_mode, q_score, q_jewel, q_level, q_class, q_time);
-    // Allocate space for the new ranking insert.
-    u_ranks = realloc(u_ranks, u_count * sizeof(char *));
-    u_ranks[(int)u_count - 1] = calloc(strlen(r_str) + 2, sizeof(char));
-    strcpy(u_ranks[(int)u_count - 1], r_str);
+// Send the server metrics in the Prometheus text format.
+void get_metrics(struct mg_connection *c, struct mg_http_message *hm)
+{
+  struct sbuf b = { 0 }; char label[40];
+  sb_http(&b, "Content-Type: text/plain; version=0.0.4\r\n");
+  sb_printf(&b, "# TYPE jm_requests_total counter\n");
+  for (int r = 0; r < MT_ROUTES; r++) {
+    for (int i = 0; i < MT_CODES; i++) {
+      unsigned long long n = atomic_load_explicit(&mt_status_count[r][i], memory_order_relaxed);
+      if (n > 0) { sb_printf(&b, "jm_requests_total{route=\"%s\",code=\"%s%d\"} %llu\n", mt_routes[r], i == MT_CODES - 1 ? "other_" : "", mt_codes[i], n); }
+    }
   }
-
-  // Sort the user rankings for storage, to avoid having to sort on each ranking request (and duplicate all the code from above).
-  qsort(u_ranks, (int)u_count, sizeof(char *), cmp_asc);
-  // Build user rankings object array string.
-  char *u_ranks_str = calloc(1, sizeof(char));
-  for (int i = 0; i < u_count; i++) {
-    u_ranks_str = realloc(u_ranks_str, strlen(u_ranks_str) + strlen(u_ranks[i]) + 2);
-    if (i != 0) { strcat(u_ranks_str, ","); }
-    strcat(u_ranks_str, u_ranks[i]);
+  sb_printf(&b, "# TYPE jm_request_duration_seconds histogram\n");
+  for (int r = 0; r < MT_ROUTES; r++) {
+    snprintf(label, sizeof(label), "route=\"%s\"", mt_routes[r]);
+    mt_print_hist(&b, "jm_request_duration_seconds", label, &mt_latency[r]);
+  }
+  sb_printf(&b, "# TYPE jm_db_txn_duration_seconds histogram\n");
+  for (int o = 0; o < MT_DB_OPS; o++) {
+    snprintf(label, sizeof(label), "op=\"%s\"", mt_db_ops[o]);
+    mt_print_hist(&b, "jm_db_txn_duration_seconds", label, &mt_db_txn[o]);
   }
-  // Build final user object string and update the entry on the database.
-  char u_pass[20];
-  mjson_get_string(user, strlen(user), "$.pass", u_pass, sizeof(u_pass));
-  char u_str[strlen(u_ranks_str) + 100];
-  snprintf(u_str, strlen(u_ranks_str) + 100, "{\"id\":\"%s\",\"pass\":\"%s\",\"count\":%d,\"rankings\":[%s]}", q_id, u_pass, (int)u_count, u_ranks_str);
-  db_put(dbi_user, q_id, u_str);
-  free(u_ranks_str);
+  sb_printf(&b, "# TYPE jm_db_commit_duration_seconds histogram\n");
+  mt_print_hist(&b, "jm_db_commit_duration_seconds", "op=\"put\"", &mt_db_commit);
+
+  // Live connections are counted on each scrape, leaving out the listener and the worker threads pipe.
+  int conns = 0;
+  for (struct mg_connection *t = c->mgr->conns; t != NULL; t = t->next) { conns += t->is_accepted; }
+  sb_printf(&b, "# TYPE jm_connections gauge\njm_connections %d\n", conns);
+  sb_printf(&b, "# TYPE jm_connections_accepted_total counter\njm_connections_accepted_total %llu\n", atomic_load(&mt_accepted));
+  sb_printf(&b, "# TYPE jm_replay_read_bytes_total counter\njm_replay_read_bytes_total %llu\n", atomic_load(&mt_rep_read));
+  sb_printf(&b, "# TYPE jm_replay_written_bytes_total counter\njm_replay_written_bytes_total %llu\n", atomic_load(&mt_rep_written));
+  sb_printf(&b, "# TYPE jm_replay_cache_hits_total counter\njm_replay_cache_hits_total %llu\n", rc_hits);
+  sb_printf(&b, "# TYPE jm_replay_cache_misses_total counter\njm_replay_cache_misses_total %llu\n", rc_misses);
+  sb_printf(&b, "# TYPE jm_replay_cache_bytes gauge\njm_replay_cache_bytes %llu\n", (unsigned long long)rc_bytes);
+  sb_printf(&b, "# TYPE jm_arena_bytes gauge\njm_arena_bytes %llu\n", (unsigned long long)req_arena.size);
+  sb_printf(&b, "# TYPE jm_arena_allocations_total counter\njm_arena_allocations_total %llu\n", req_arena.allocs);
+  mt_print_resources(&b);
+  sb_send(c, &b);
+}
+
+// Get main menu message.
+void get_message(struct mg_connection *c, struct mg_http_message *hm)
+{
+  http_reply(c, HT_OK, "Jewelry Master Server Emulator by Hipnosis, 2022\n");
+}
 
-  // Free memory allocated for user rankings and data.
-  for (int i = 0; i < u_count; i++) {
-    free(u_ranks[i]);
-  } free(u_ranks); free(user);
-  mg_http_reply(c, 200, NULL, "");
+// Unkwnown usage. Probably unused?. Params: 'id'.
+void get_name(struct mg_connection *c, struct mg_http_message *hm)
+{
+  http_reply(c, HT_OK, "");
+}
+
+// Write the recorded traces to file.
+void get_trace(struct mg_connection *c, struct mg_http_message *hm)
+{
+  int n = tr_dump(tr_path);
+  if (n >= 0) { mg_http_reply(c, 200, NULL, "%d spans written to %s\n", n, tr_path); }
+  else { mg_http_reply(c, 500, NULL, "Couldn't write %s\n", tr_path); }
+}
+
+// Route flags. Game routes are logged, rate limited and shed while overloaded.
+// Write routes take from the clients writing rate instead, and are disabled by the 'NoScores' option.
+// Local routes are only answered to clients on the loopback address, the others get a not found reply.
+#define RT_GAME 1
+#define RT_WRITE 2
+#define RT_LOCAL 4
+
+// Server routes, matched by their exact path. Routes can be enabled by an option, or always if none is given.
+struct route {
+  const char *path, *method; int metric, flags;
+  void (*fn)(struct mg_connection *c, struct mg_http_message *hm);
+  const int *enabled;
+};
+static const struct route routes[] = {
+  { "/JM_test/service/GameEntry", "GET", MT_GAMEENTRY, RT_GAME, game_entry, NULL },
+  { "/JM_test/service/GetMessage", "GET", MT_GETMESSAGE, RT_GAME, get_message, NULL },
+  { "/JM_test/service/GetName", "GET", MT_GETNAME, RT_GAME, get_name, NULL },
+  { "/JM_test/service/GetRanking", "GET", MT_GETRANKING, RT_GAME, get_ranking, NULL },
+  { "/JM_test/service/GetReplay", "GET", MT_GETREPLAY, RT_GAME, get_replay, NULL },
+  { "/JM_test/service/ScoreEntry", "POST", MT_SCOREENTRY, RT_GAME | RT_WRITE, score_entry, NULL },
+  { "/metrics", "GET", MT_METRICS, RT_LOCAL, get_metrics, &METRICS },
+  { "/trace", "GET", MT_TRACE, RT_LOCAL, get_trace, &TRACE },
+};
+
+// Check if an address is a loopback one, 127.0.0.0/8 or ::1, including IPv4 mapped IPv6 addresses.
+int is_loopback(const struct mg_addr *a)
+{
+  static const unsigned char lo6[16] = { [15] = 1 }, mapped[12] = { [10] = 0xff, [11] = 0xff };
+  if (!a->is_ip6) { return ((const unsigned char *)&a->ip)[0] == 127; }
+  if (memcmp(a->ip6, lo6, 16) == 0) { return 1; }
+  return memcmp(a->ip6, mapped, 12) == 0 && a->ip6[12] == 127;
+}
+
+// Routes hash table, built on start with a hash seed that gives every route its own slot.
+#define RT_SLOTS 32
+static const struct route *rt_table[RT_SLOTS];
+static unsigned long long rt_seed = 0;
+
+// Get the routes table slot for a path.
+int rt_slot(const char *path, size_t len)
+{
+  return (int)(((fnv1a(path, len) ^ rt_seed) * 0x9E3779B97F4A7C15ULL) >> 59);
+}
+
+// Build the routes table, trying seeds until there are no collisions.
+void rt_compile()
+{
+  int n = sizeof(routes) / sizeof(routes[0]);
+  for (rt_seed = 0; rt_seed < 100000; rt_seed++) {
+    memset(rt_table, 0, sizeof(rt_table)); int i = 0;
+    for (; i < n; i++) {
+      int slot = rt_slot(routes[i].path, strlen(routes[i].path));
+      if (rt_table[slot] != NULL) { break; }
+      rt_table[slot] = &routes[i];
+    } if (i == n) { return; }
+  } log_printf(LOG_ERROR, "Server", "Couldn't build the routes table.");
+}
+
+// Find the route for a request path, or NULL if there's none.
+const struct route *rt_find(struct mg_str uri)
+{
+  const struct route *r = rt_table[rt_slot(uri.ptr, uri.len)];
+  if (r == NULL || strlen(r->path) != uri.len || memcmp(r->path, uri.ptr, uri.len) != 0) { return NULL; }
+  if (r->enabled != NULL && *r->enabled <= 0) { return NULL; }
+  return r;
+}
+
+// Log an incoming request, with its query on the info level or the whole raw request on the debug one.
+void log_request(struct mg_http_message *hm, const char *route)
+{
+  if (LOGLEVEL >= LOG_DEBUG) { log_push(LOG_DEBUG, route, hm->message.ptr, hm->message.len); }
+  else { log_push(LOG_INFO, route, hm->query.ptr, hm->query.len); }
+}
+
+// Request journal. It starts with "JMJ1", followed by a record for each request: microseconds since the Unix
+// epoch (8 bytes), method, URI and query lengths (1, 2 and 2 bytes), body length (4 bytes), and then those
+// strings. Only score entries have a body, the replay from their multipart form. Numbers are little-endian.
+// Passwords are stored as a hash salted once per run, so replayed logins still match their registrations
+// without the journal holding them in plain text.
+static FILE *jn_fp = NULL;
+static double jn_flushed = 0;
+static char jn_salt[8];
+
+// Open the request journal, if enabled.
+void jn_init(const char *dir)
+{
+  if (strlen(JOURNAL) == 0) { return; }
+  char path[MAX_PATH]; snprintf(path, MAX_PATH, "%s\\%s", dir, JOURNAL);
+  if ((jn_fp = fopen(path, "ab")) == NULL) { log_printf(LOG_ERROR, "Journal", "Couldn't open %s.", path); return; }
+  fseek(jn_fp, 0, SEEK_END);
+  if (ftell(jn_fp) == 0) { fwrite("JMJ1", 1, 4, jn_fp); }
+  FILETIME ft; GetSystemTimeAsFileTime(&ft);
+  unsigned long long salt = fnv1a((const char *)&ft, sizeof(ft)) ^ GetCurrentProcessId();
+  memcpy(jn_salt, &salt, sizeof(jn_salt));
+}
+
+// Store a little-endian number of the given size.
+void jn_put(unsigned char *p, unsigned long long v, int n)
+{
+  for (int i = 0; i < n; i++) { p[i] = (unsigned char)(v >> (i * 8)); }
+}
+
+// Copy a query replacing the values of its 'pass' parameters with their salted hash.
+// Returns the length of the copy, which is cut short if it doesn't fit.
+size_t jn_mask(struct mg_str q, char *buf, size_t size)
+{
+  size_t len = 0; const char *p = q.ptr, *end = q.ptr + q.len;
+  while (p < end) {
+    const char *amp = memchr(p, '&', end - p); if (amp == NULL) { amp = end; }
+    size_t n = amp - p; char hex[17];
+    if (n >= 5 && memcmp(p, "pass=", 5) == 0) {
+      // The salt goes on both sides, so similar passwords don't end up with similar hashes.
+      char salted[64]; size_t v_len = n - 5 < sizeof(salted) - 2 * sizeof(jn_salt) ? n - 5 : sizeof(salted) - 2 * sizeof(jn_salt);
+      memcpy(salted, jn_salt, sizeof(jn_salt)); memcpy(salted + sizeof(jn_salt), p + 5, v_len);
+      memcpy(salted + sizeof(jn_salt) + v_len, jn_salt, sizeof(jn_salt));
+      snprintf(hex, sizeof(hex), "%016llx", fnv1a(salted, 2 * sizeof(jn_salt) + v_len));
+      if (len + 5 + 16 + 1 > size) { break; }
+      memcpy(buf + len, "pass=", 5); memcpy(buf + len + 5, hex, 16); len += 21;
+    } else {
+      if (len + n + 1 > size) { break; }
+      memcpy(buf + len, p, n); len += n;
+    }
+    if (amp < end) { buf[len++] = '&'; }
+    p = amp + 1;
+  } return len;
+}
+
+// Append a request to the journal. Writes are buffered, and flushed once a second from the server loop.
+void jn_write(struct mg_http_message *hm, int route)
+{
+  if (jn_fp == NULL) { return; }
+  static char query[0xffff];
+  struct mg_str q = hm->query;
+  if (route == MT_GAMEENTRY) { q.len = jn_mask(hm->query, query, sizeof(query)); q.ptr = query; }
+  struct mg_http_part part = { 0 };
+  if (route == MT_SCOREENTRY) { mg_http_next_multipart(hm->body, 0, &part); }
+  FILETIME ft; GetSystemTimeAsFileTime(&ft);
+  unsigned long long us = ((((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime) - 116444736000000000ULL) / 10;
+  size_t m_len = hm->method.len < 0xff ? hm->method.len : 0xff;
+  size_t u_len = hm->uri.len < 0xffff ? hm->uri.len : 0xffff, q_len = q.len < 0xffff ? q.len : 0xffff;
+  unsigned char h[17];
+  jn_put(h, us, 8); h[8] = (unsigned char)m_len; jn_put(h + 9, u_len, 2); jn_put(h + 11, q_len, 2); jn_put(h + 13, part.body.len, 4);
+  fwrite(h, 1, sizeof(h), jn_fp); fwrite(hm->method.ptr, 1, m_len, jn_fp);
+  fwrite(hm->uri.ptr, 1, u_len, jn_fp); fwrite(q.ptr, 1, q_len, jn_fp);
+  if (part.body.len > 0) { fwrite(part.body.ptr, 1, part.body.len, jn_fp); }
+}
+
+// Write the buffered journal records, at most once a second.
+void jn_flush()
+{
+  double t = now_ms();
+  if (jn_fp != NULL && t - jn_flushed >= 1000) { fflush(jn_fp); jn_flushed = t; }
 }
 
 // Main server polling function, runs forever.
 static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
 {
+  if (ev == MG_EV_ACCEPT) { atomic_fetch_add_explicit(&mt_accepted, 1, memory_order_relaxed); }
   if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = (struct mg_http_message *)ev_data;
-    if (mg_http_match_uri(hm, "/JM_test/service/GameEntry")) {
-      printf("-GameEntry:\n%s", hm->query.ptr);
-      game_entry(c, hm);
-    // Get main menu message.
-    } else if (mg_http_match_uri(hm, "/JM_test/service/GetMessage")) {
-      printf("-GetMessage: %s\n\n", hm->query.ptr);
-      mg_http_reply(c, 200, NULL, "Jewelry Master Server Emulator by Hipnosis, 2022\n");
-    // Unkwnown usage. Probably unused?. Params: 'id'.
-    } else if (mg_http_match_uri(hm, "/JM_test/service/GetName")) {
-      printf("-GetName:\n%s", hm->query.ptr);
-      mg_http_reply(c, 200, NULL, "");
-    } else if (mg_http_match_uri(hm, "/JM_test/service/GetRanking")) {
-      printf("-GetRanking:\n%s", hm->query.ptr);
-      get_ranking(c, hm);
-    } else if (mg_http_match_uri(hm, "/JM_test/service/GetReplay")) {
-      printf("-GetReplay:\n%s", hm->query.ptr);
-      get_replay(c, hm);
-    } else if (mg_http_match_uri(hm, "/JM_test/service/ScoreEntry")) {
-      printf("-ScoreEntry:\n%s", hm->query.ptr);
-      if (!NOSCORES) { score_entry(c, hm); }
-      else { mg_http_reply(c, 404, NULL, ""); }
-    } else { mg_http_reply(c, 404, NULL, ""); }
+    // Time the request and check its reply status, unless it's deferred to the worker threads.
+    double t = now_ms(); size_t ofs = c->send.len;
+    // Sampled requests get their phases traced.
+    tr_req = TRACE > 0 && ++tr_count % TRACE == 0 ? tr_count : 0;
+    const struct route *r = rt_find(hm->uri);
+    int route = r ? r->metric : MT_OTHER;
+    jn_write(hm, route);
+    if (r == NULL || ((r->flags & RT_LOCAL) && !is_loopback(&c->rem))) {
+      http_reply(c, HT_NOT_FOUND, "");
+    } else if (mg_vcmp(&hm->method, r->method) != 0) {
+      char allow[20]; snprintf(allow, sizeof(allow), "Allow: %s\r\n", r->method);
+      mg_http_reply(c, 405, allow, "");
+    // Shed game requests early while overloaded, and limit the ones from each client, before any database work.
+    } else if ((r->flags & RT_GAME) && !ad_allow()) {
+      http_reply(c, HT_UNAVAILABLE, "");
+    } else if ((r->flags & RT_GAME) && !rl_allow(c, r->flags & RT_WRITE)) {
+      http_reply(c, HT_TOO_MANY, "");
+    } else {
+      if (r->flags & RT_GAME) { log_request(hm, mt_routes[route]); }
+      if ((r->flags & RT_WRITE) && NOSCORES) { http_reply(c, HT_NOT_FOUND, ""); }
+      else { r->fn(c, hm); }
+      // The reply is queued or deferred by now, so the handler temporaries can go.
+      ar_reset(&req_arena);
+    }
+    // Show the replays storage statistics after using it.
+    if (route == MT_GETREPLAY) {
+      log_printf(LOG_DEBUG, "Replays", "Cache: %llu hits, %llu misses, %llu bytes.", rc_hits, rc_misses, (unsigned long long)rc_bytes);
+    } else if (route == MT_SCOREENTRY && LOGLEVEL >= LOG_DEBUG) {
+      struct rz_stats st; rz_get_stats(&st);
+      if (st.count > 0) {
+        log_printf(LOG_DEBUG, "Replays", "Compression: %.1f%% of the original size, %.3f ms to compress and %.3f ms to decompress on average.",
+          st.packed * 100.0 / st.raw, st.deflate_ms / st.count, st.inflates ? st.inflate_ms / st.inflates : 0);
+      }
+    }
+    int status = mt_reply_status(c, ofs);
+    double e = now_ms(); ad_work += e - t;
+    if (status) { mt_request(route, status, e - t); }
+    tr_end(mt_routes[route], t); tr_req = 0;
   }
   // Check if the game has been closed.
   if (SERVERMODE != 2 && GetExitCodeProcess(pi.hProcess, &code)) {
@@ -549,10 +805,10 @@ int main(int argc, char *argv[])
     CreateDirectory(srv, NULL);
     CreateDirectory(db, NULL);
     CreateDirectory(rep, NULL);
-  }
+  } snprintf(REPDIR, MAX_PATH, "%s\\server\\rep", dir);
 
   // Load configuration options from file.
-  char ini[MAX_PATH]; char *svr_p, *hdl_p, *ncl_p, *reg_p, *mul_p, *nsc_p;
+  char ini[MAX_PATH]; char *svr_p, *hdl_p, *ncl_p, *reg_p, *mul_p, *nsc_p, *zcp_p, *rpc_p, *cmp_p, *pak_p, *pks_p, *aio_p, *iot_p, *map_p, *mts_p, *rdr_p, *wrr_p, *mxq_p, *mxl_p, *llv_p, *trs_p;
   snprintf(ini, MAX_PATH, "%s\\server.ini", dir);
   ini_t *config = ini_load(ini);
   if (config) {
@@ -562,14 +818,56 @@ int main(int argc, char *argv[])
     const char *reg = ini_get(config, "Options", "Register");
     const char *mul = ini_get(config, "Options", "MultiScores");
     const char *nsc = ini_get(config, "Options", "NoScores");
+    const char *zcp = ini_get(config, "Options", "ZeroCopy");
+    const char *rpc = ini_get(config, "Options", "ReplayCache");
+    const char *cmp = ini_get(config, "Options", "CompressReplays");
+    const char *pak = ini_get(config, "Options", "PackReplays");
+    const char *pks = ini_get(config, "Options", "PackSize");
+    const char *aio = ini_get(config, "Options", "AsyncIO");
+    const char *iot = ini_get(config, "Options", "IOThreads");
+    const char *map = ini_get(config, "Options", "MapSize");
     if (svr) { SERVERMODE = strtol(svr, &svr_p, 10); }
     if (hst && SERVERMODE != 0) { snprintf(HOSTNAME, 16, hst); }
     if (hdl) { HOOKDLL = strtol(hdl, &hdl_p, 10); }
     if (reg) { REGISTER = strtol(reg, &reg_p, 10); }
     if (mul) { MULTISCORES = strtol(mul, &mul_p, 10); }
-    if (nsc) { NOSCORES = strtol(nsc, &nsc_p, 10); } ini_free(config);
+    if (nsc) { NOSCORES = strtol(nsc, &nsc_p, 10); }
+    if (zcp) { ZEROCOPY = strtol(zcp, &zcp_p, 10); }
+    if (rpc) { REPLAYCACHE = strtol(rpc, &rpc_p, 10); }
+    if (cmp) { COMPRESS = strtol(cmp, &cmp_p, 10); }
+    if (pak) { PACKREPLAYS = strtol(pak, &pak_p, 10); }
+    if (pks) { PACKSIZE = strtol(pks, &pks_p, 10); }
+    // Pack offsets go through fseek(), which takes a long.
+    if (PACKSIZE > 1024) { PACKSIZE = 1024; }
+    if (aio) { ASYNCIO = strtol(aio, &aio_p, 10); }
+    if (iot) { IOTHREADS = strtol(iot, &iot_p, 10); }
+    if (map) { MAPSIZE = strtol(map, &map_p, 10); }
+    const char *mts = ini_get(config, "Options", "Metrics");
+    if (mts) { METRICS = strtol(mts, &mts_p, 10); }
+    const char *rdr = ini_get(config, "Limits", "ReadRate");
+    const char *wrr = ini_get(config, "Limits", "WriteRate");
+    const char *mxq = ini_get(config, "Limits", "MaxQueue");
+    const char *mxl = ini_get(config, "Limits", "MaxLag");
+    if (rdr) { READRATE = strtol(rdr, &rdr_p, 10); }
+    if (wrr) { WRITERATE = strtol(wrr, &wrr_p, 10); }
+    if (mxq) { MAXQUEUE = strtol(mxq, &mxq_p, 10); }
+    if (mxl) { MAXLAG = strtol(mxl, &mxl_p, 10); }
+    const char *llv = ini_get(config, "Log", "Level");
+    const char *lfl = ini_get(config, "Log", "File");
+    const char *jnl = ini_get(config, "Log", "Journal");
+    if (llv) { LOGLEVEL = strtol(llv, &llv_p, 10); }
+    if (lfl) { snprintf(LOGFILE, MAX_PATH, "%s", lfl); }
+    if (jnl) { snprintf(JOURNAL, MAX_PATH, "%s", jnl); }
+    const char *trs = ini_get(config, "Trace", "Sample");
+    const char *trf = ini_get(config, "Trace", "File");
+    if (trs) { TRACE = strtol(trs, &trs_p, 10); }
+    if (trf) { snprintf(TRACEFILE, MAX_PATH, "%s", trf); } ini_free(config);
   }
 
+  // Start logging, before anything else can log.
+  log_init(dir); jn_init(dir);
+  snprintf(tr_path, MAX_PATH, "%s\\%s", dir, TRACEFILE); tr_init();
+
   // Close console window on start.
   if (SERVERMODE != 2) {
     HWND hWnd = GetConsoleWindow();
@@ -582,6 +880,12 @@ int main(int argc, char *argv[])
     // Intialize random number generator for replays ids.
     // Required for random_num() to have a unique seed.
     srand(time(NULL));
+    // Move replays left in the old flat layout in the background.
+    pthread_t migrate; MIGRATING = 1;
+    pthread_create(&migrate, NULL, rep_migrate, NULL);
+    pthread_detach(migrate);
+    // Find the active pack file and compact old ones in the background.
+    pk_init(); pk_start();
   }
 
   // Create game executable process.
@@ -598,14 +902,16 @@ int main(int argc, char *argv[])
 
   // Manage and start web server.
   if (SERVERMODE != 1) {
-    char url[40], mes[80];
+    char url[40];
     snprintf(url, 40, "http://%s:8081", HOSTNAME);
-    snprintf(mes, 80, "Server for Jewelry Master created on %s\n\n", url);
     struct mg_mgr mgr;
-    mg_mgr_init(&mgr); printf(mes);
-    mg_http_listen(&mgr, url, fn, &mgr);
-    while (RUN) { mg_mgr_poll(&mgr, 1000); }
+    mg_mgr_init(&mgr);
+    log_printf(LOG_INFO, "Server", "Server for Jewelry Master created on %s", url);
+    rt_compile(); mg_http_listen(&mgr, url, fn, &mgr); io_start(&mgr);
+    while (RUN) { mg_mgr_poll(&mgr, 1000); ad_lag = ad_lag * 0.8 + ad_work * 0.2; ad_work = 0; jn_flush(); }
     // Close server and database and exit the program.
-    mg_mgr_free(&mgr); db_close();
-  } return 0;
+    io_drain(); mg_mgr_free(&mgr); pk_join(); pk_close(); db_close();
+    if (jn_fp != NULL) { fclose(jn_fp); }
+    if (TRACE > 0) { tr_dump(tr_path); }
+  } log_close(); return 0;
 }
\ No newline at end of file
@@ -2,13 +2,14 @@
 import express from 'express';
 const app = express();
 
-// Server constants.
+// Server constants. The port and the database can be changed with JM_PORT and JM_MONGODB,
+// to run the server next to the C one or on a throwaway database.
 const hostname = '127.0.0.1';
-const hostport = '8081';
+const hostport = process.env.JM_PORT || '8081';
 
 // Manage database initialization.
 import mongoose from 'mongoose';
-const mongoDB = `mongodb://${hostname}/jm`;
+const mongoDB = process.env.JM_MONGODB || `mongodb://${hostname}/jm`;
 mongoose.connect(mongoDB, { useNewUrlParser: true, useUnifiedTopology: true });
 mongoose.connection.on('error', (e) => { console.error.bind(console, e) });
 
@@ -0,0 +1,11 @@
+// Start the server on a throwaway in-memory MongoDB, for the differential harness in server-c/bench.
+// Listens on port 8082 by default so it can run next to the C server, set JM_PORT to change it.
+import { MongoMemoryServer } from 'mongodb-memory-server';
+
+const mongod = await MongoMemoryServer.create();
+process.env.JM_MONGODB = mongod.getUri('jm');
+process.env.JM_PORT = process.env.JM_PORT || '8082';
+
+// Stop the database along with the server.
+process.on('SIGINT', async () => { await mongod.stop(); process.exit(0); });
+await import('../app.js');
\ No newline at end of file